@@ -0,0 +1,251 @@
+#! /usr/bin/env python3
+
+#  This file is part of smoothscan.
+#
+#  smoothscan is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published
+#  by the Free Software Foundation, either version 3 of the License,
+#  or (at your option) any later version.
+#
+#  smoothscan is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+#  General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with smoothscan. If not, see <http://www.gnu.org/licenses/>.
+
+
+# End-to-end benchmarks. Each case renders a synthetic book with
+# smoothscan-genbook.py, converts it with the built smoothscan and
+# records wall time, per stage time (from --stats), peak memory, output
+# size and the number of classes and fonts. The results are compared against a
+# baseline, and any case that got slower, bigger or hungrier than the
+# tolerance allows fails the run.
+#
+# Output size and the class and font counts only depend on the code, so
+# their baseline is committed as bench/baseline.json. Time and memory
+# depend on the machine, so their baseline is kept next to the build
+# and only compared when it exists.
+
+import argparse
+import json
+import os
+import shutil
+import stat
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+SERIF = "/usr/share/fonts/truetype/dejavu/DejaVuSerif.ttf"
+SANS = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"
+
+# name, pages, dpi, typeface, noise
+CASES = (
+    ("clean-300dpi", 10, 300, SERIF, 0.0),
+    ("noisy-300dpi", 10, 300, SERIF, 0.002),
+    ("clean-600dpi", 5, 600, SERIF, 0.0),
+    ("sans-long", 40, 300, SANS, 0.0005),
+)
+
+# Allowed growth over the baseline before a case counts as a regression,
+# for the metrics in the committed baseline and the machine-local one.
+TOLERANCE = {
+    "output_bytes": 0.05,
+    "classes": 0.05,
+    "fonts": 0.05,
+}
+LOCAL_TOLERANCE = {
+    "wall": 0.20,
+    "peak_rss_kb": 0.15,
+}
+
+def parseArgs():
+    parser = argparse.ArgumentParser(description=
+                                     "Run the smoothscan benchmarks.")
+    parser.add_argument("--smoothscan", default="./smoothscan",
+                        help="smoothscan binary to benchmark")
+    parser.add_argument("--fontgen", default="src/smoothscan-fontgen.py",
+                        help="built smoothscan-fontgen.py")
+    parser.add_argument("--baseline",
+                        default=os.path.join(BENCH_DIR, "baseline.json"),
+                        help="baseline of the machine independent metrics")
+    parser.add_argument("--local-baseline", default="bench-local.json",
+                        help="baseline of the time and memory use")
+    parser.add_argument("--results", default="bench-results.json")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="write the results as the new baselines")
+    parser.add_argument("--case", action="append",
+                        help="only run the named case")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the working directory")
+    return parser.parse_args()
+
+def setupBin(workdir, fontgen):
+    # smoothscan finds the font generator on the PATH
+    bindir = os.path.join(workdir, "bin")
+    os.mkdir(bindir)
+    dest = os.path.join(bindir, "smoothscan-fontgen.py")
+    shutil.copy(fontgen, dest)
+    os.chmod(dest, os.stat(dest).st_mode | stat.S_IXUSR)
+    env = dict(os.environ)
+    env["PATH"] = bindir + os.pathsep + env.get("PATH", "")
+    return env
+
+def readStats(filename):
+    with open(filename) as f:
+        stats = json.load(f)
+    result = {"stages": {}}
+    for stage, values in stats["stages"].items():
+        if (values["calls"] > 0):
+            result["stages"][stage] = values["seconds"]
+    result["classes"] = stats["counters"]["classes"]
+    result["fonts"] = stats["counters"]["fonts"]
+    result["glyphs_traced"] = stats["counters"]["glyphs_traced"]
+    return result
+
+def runCase(case, smoothscan, env, workdir):
+    name, pages, dpi, typeface, noise = case
+    if (typeface != "default" and not os.path.exists(typeface)):
+        typeface = "default"
+
+    book = os.path.join(workdir, name + ".tif")
+    pdf = os.path.join(workdir, name + ".pdf")
+    statsfile = os.path.join(workdir, name + ".json")
+    subprocess.check_call([sys.executable,
+                           os.path.join(BENCH_DIR, "smoothscan-genbook.py"),
+                           book, "--pages", str(pages), "--dpi", str(dpi),
+                           "--typeface", typeface, "--noise", str(noise)])
+
+    start = time.monotonic()
+    proc = subprocess.Popen([smoothscan, "--stats", statsfile, "-o", pdf, book],
+                            env=env, stdout=subprocess.PIPE,
+                            universal_newlines=True)
+    output = proc.stdout.read()
+    pid, status, usage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+
+    if (proc.returncode != 0):
+        print(output, file=sys.stderr)
+        raise RuntimeError("%s: smoothscan exited with %d"
+                           % (name, proc.returncode))
+
+    result = readStats(statsfile)
+    result["wall"] = wall
+    # ru_maxrss is in kilobytes on Linux
+    result["peak_rss_kb"] = usage.ru_maxrss
+    result["output_bytes"] = os.path.getsize(pdf)
+    result["pages"] = pages
+    return result
+
+def compare(name, result, base, tolerances, warnings):
+    failures = []
+    for key, tolerance in sorted(tolerances.items()):
+        if (key not in result):
+            continue
+        if (base.get(key) is None):
+            warnings.append("%s: no baseline for %s" % (name, key))
+            continue
+        if (base[key] <= 0):
+            continue
+        growth = (result[key] - base[key]) / float(base[key])
+        if (growth > tolerance):
+            failures.append("%s: %s %g -> %g (+%.1f%%, allowed %.0f%%)"
+                            % (name, key, base[key], result[key],
+                               100 * growth, 100 * tolerance))
+    return failures
+
+def printResult(name, result):
+    stages = " ".join("%s=%.2f" % (stage, sec)
+                      for stage, sec in result["stages"].items())
+    print("%-14s %6.2fs %8d KB %10d bytes %6s classes %3s fonts  %s"
+          % (name, result["wall"], result["peak_rss_kb"],
+             result["output_bytes"], result.get("classes", "?"),
+             result.get("fonts", "?"), stages))
+
+def loadBaseline(filename):
+    if (not os.path.exists(filename)):
+        return None
+    with open(filename) as f:
+        return json.load(f)
+
+def writeBaseline(filename, results, keys):
+    # Cases that were not run keep their old baseline
+    baseline = loadBaseline(filename) or {}
+    for name, result in results.items():
+        baseline[name] = dict((key, result[key]) for key in keys
+                              if key in result)
+    with open(filename, "w") as f:
+        json.dump(baseline, f, indent=2, sort_keys=True)
+        f.write("\n")
+    print("Baseline written to %s" % filename)
+
+def main():
+    args = parseArgs()
+
+    # The committed baseline is what catches a regression, so without
+    # it say so before spending minutes on the cases.
+    if (not args.update_baseline and not os.path.exists(args.baseline)):
+        print("No baseline at %s, run make bench-baseline to create one"
+              % args.baseline, file=sys.stderr)
+        return 1
+
+    workdir = tempfile.mkdtemp(prefix="smoothscan-bench-")
+    env = setupBin(workdir, args.fontgen)
+    smoothscan = os.path.abspath(args.smoothscan)
+
+    results = {}
+    try:
+        for case in CASES:
+            if (args.case and case[0] not in args.case):
+                continue
+            results[case[0]] = runCase(case, smoothscan, env, workdir)
+            printResult(case[0], results[case[0]])
+    finally:
+        if (args.keep):
+            print("Benchmark files kept in %s" % workdir)
+        else:
+            shutil.rmtree(workdir)
+
+    with open(args.results, "w") as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+
+    if (args.update_baseline):
+        writeBaseline(args.baseline, results, TOLERANCE)
+        writeBaseline(args.local_baseline, results, LOCAL_TOLERANCE)
+        return 0
+
+    baseline = loadBaseline(args.baseline)
+    local = loadBaseline(args.local_baseline)
+
+    failures = []
+    warnings = []
+    if (local is None):
+        warnings.append("no time and memory baseline at %s, run make"
+                        " bench-baseline to record one for this machine"
+                        % args.local_baseline)
+        local = {}
+    for name, result in sorted(results.items()):
+        if (name in baseline):
+            failures += compare(name, result, baseline[name], TOLERANCE,
+                                warnings)
+        else:
+            failures.append("%s: not in the baseline, run make"
+                            " bench-baseline" % name)
+        if (name in local):
+            failures += compare(name, result, local[name], LOCAL_TOLERANCE,
+                                warnings)
+
+    for warning in warnings:
+        print("WARNING %s" % warning, file=sys.stderr)
+    for failure in failures:
+        print("REGRESSION %s" % failure, file=sys.stderr)
+
+    return 1 if failures else 0
+
+if (__name__ == "__main__"):
+    sys.exit(main())
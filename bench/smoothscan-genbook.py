@@ -0,0 +1,114 @@
+#! /usr/bin/env python3
+
+#  This file is part of smoothscan.
+#
+#  smoothscan is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published
+#  by the Free Software Foundation, either version 3 of the License,
+#  or (at your option) any later version.
+#
+#  smoothscan is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+#  General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with smoothscan. If not, see <http://www.gnu.org/licenses/>.
+
+
+# Render a synthetic scanned book as a multi-page 1bpp TIFF, for the
+# benchmarks. The same arguments always give the same book: the text,
+# the layout and the scanner noise all come from the seed.
+
+import argparse
+import random
+import sys
+
+from PIL import Image, ImageDraw, ImageFont
+
+# Words are drawn from a fixed vocabulary, so the class count depends
+# on the typeface and noise, not on chance.
+WORDS = ("the of and to in is was that for it with as his on be at by "
+         "had not are but from or have an they which one you were her "
+         "all she there would their we him been has when who will more "
+         "no if out so said what up its about into than them can only "
+         "other new some could time these two may then do first any my "
+         "now such like our over man me even most made after also did "
+         "many before must through back years where much your way well "
+         "down should because each just those people Mr how too little "
+         "state good very make world still own see men work long get "
+         "here between both life being under never day same another "
+         "know while last might us great old year off come since against "
+         "go came right used take three Chapter I II III IV V 1 2 3 4 5 "
+         "6 7 8 9 0 , . ; : ! ? ' \" ( ) -").split()
+
+def parseArgs():
+    parser = argparse.ArgumentParser(description=
+                                     "Render a synthetic scanned book.")
+    parser.add_argument("output", help="multi-page TIFF to write")
+    parser.add_argument("--pages", type=int, default=10)
+    parser.add_argument("--dpi", type=int, default=300)
+    parser.add_argument("--typeface", default="default",
+                        help="TrueType font file, or default")
+    parser.add_argument("--point-size", type=float, default=11)
+    parser.add_argument("--noise", type=float, default=0.0,
+                        help="fraction of pixels flipped by the 'scanner'")
+    parser.add_argument("--seed", type=int, default=1)
+    return parser.parse_args()
+
+def loadFont(typeface, pixels):
+    if (typeface == "default"):
+        return ImageFont.load_default(pixels)
+    return ImageFont.truetype(typeface, pixels)
+
+def renderPage(rng, font, dpi, lineHeight):
+    # US letter, one inch margins
+    w = int(8.5 * dpi)
+    h = int(11 * dpi)
+    margin = dpi
+    page = Image.new("L", (w, h), 255)
+    draw = ImageDraw.Draw(page)
+
+    y = margin
+    while (y + lineHeight < h - margin):
+        x = margin
+        while True:
+            word = rng.choice(WORDS)
+            wordWidth = draw.textlength(word + " ", font=font)
+            if (x + wordWidth > w - margin):
+                break
+            draw.text((x, y), word, font=font, fill=0)
+            x += wordWidth
+        y += lineHeight
+
+    return page.point(lambda v: 0 if v < 128 else 255, "1")
+
+def addNoise(rng, page, noise):
+    if (noise <= 0):
+        return page
+    w, h = page.size
+    pixels = page.load()
+    for i in range(int(w * h * noise)):
+        x = rng.randrange(w)
+        y = rng.randrange(h)
+        pixels[x, y] = 255 - pixels[x, y]
+    return page
+
+def main():
+    args = parseArgs()
+    rng = random.Random(args.seed)
+    pixels = int(round(args.point_size * args.dpi / 72.0))
+    font = loadFont(args.typeface, pixels)
+    lineHeight = int(pixels * 1.4)
+
+    pages = []
+    for i in range(args.pages):
+        page = renderPage(rng, font, args.dpi, lineHeight)
+        pages.append(addNoise(rng, page, args.noise))
+
+    pages[0].save(args.output, save_all=True, append_images=pages[1:],
+                  compression="group4", dpi=(args.dpi, args.dpi))
+    return 0
+
+if (__name__ == "__main__"):
+    sys.exit(main())
@@ -17,18 +17,31 @@
 
 #define _GNU_SOURCE
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* Standard headers */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
 
 /* POSIX specific headers */
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <signal.h>
 
 #include <ftw.h>
+#include <pthread.h>
 
 /* GNU specific headers (Work on Windows?)*/
 #include <getopt.h>
@@ -36,6 +49,15 @@
 /* 3rd party library headers */
 #include <leptonica/allheaders.h>
 #include <hpdf.h>
+/* libharu internals, to load fonts from memory */
+#include <hpdf_fontdef.h>
+#include <hpdf_streams.h>
+#ifdef HAVE_TESSERACT
+#include <tesseract/capi.h>
+#endif
+#ifdef HAVE_QPDF
+#include <qpdf/qpdf-c.h>
+#endif
 /* #include <potracelib.h> */
 
 #include "smoothscan.h"
@@ -43,59 +65,309 @@
 int
 main (int argc, char *argv[])
 {
+  int i;
   struct args *args = parse_args (argc, argv);
 
   validate_args (args);
 
-  JBDATA *data =
-    classify_components (args->num_input_files, args->input_files,
-			 args->thresh, args->weight);
+  stats_init (args->stats_file != NULL || args->trace_file != NULL,
+	      args->trace_file != NULL);
+
+  /* Only the new pages are converted, and added to the book */
+  struct pdf_info *book = NULL;
+
+  if (args->update_file != NULL)
+    {
+      book = read_pdf_info (args->update_file);
+
+      if (args->replace_page > book->num_kids + 1)
+	{
+	  error_quit ("--replace must be a page of the book, or the one "
+		      "after the last.");
+	}
+
+      printf ("Updating %s, %d pages\n", args->update_file, book->num_kids);
+    }
+
+  struct page_source *pages =
+    open_page_source (args->num_input_files, args->input_files,
+		      args->binarize, args->threads, args->mixed);
+
+  /*
+     The volume names depend on the number of pages, and a book that
+     fits in one volume is written to outname itself
+   */
+  if (args->volume_pages > 0 && args->volume_pages < pages->num_pages)
+    {
+      int num_volumes =
+	(pages->num_pages + args->volume_pages - 1) / args->volume_pages;
+
+      for (i = 0; i < num_volumes; i++)
+	{
+	  char *name = volume_name (args->outname, i, num_volumes);
+	  confirm_overwrite (args, name);
+	  free (name);
+	}
+    }
+  else if (args->volume_pages > 0)
+    {
+      confirm_overwrite (args, args->outname);
+    }
+
+  /* Picture regions of mixed pages are kept as images */
+  struct picture_list *pictures = NULL;
+
+  if (args->mixed)
+    {
+      pictures = create_picture_list (args->jpeg_quality);
+    }
+
+  /* Pick thresh and weight from a sample of the pages */
+  if (args->auto_tune)
+    {
+      auto_tune (pages, args->threads, args->tune_target, &args->thresh,
+		 &args->weight);
+
+      if (args->consolidate > 0 && args->consolidate < args->thresh)
+	{
+	  error_quit ("Consolidation threshold must be at least the tuned "
+		      "threshold.");
+	}
+    }
+
+  /* Consolidation compares the averages of the classes' instances */
+  struct class_averages *averages = NULL;
+
+  if (args->consolidate > 0)
+    {
+      averages = create_class_averages ();
+    }
+
+  struct template_store *store = NULL;
+  JBDATA *data = classify_components (pages, pictures, averages,
+				      args->thresh, args->weight,
+				      args->template_memory, &store);
+
+  int num_merged = 0;
+
+  if (averages != NULL)
+    {
+      num_merged = consolidate_classes (data, &store, averages,
+					args->consolidate, args->weight);
+      destroy_class_averages (averages);
+    }
 
   /* Render output of leptonica's classifier, if requested */
   if (args->debug_render_pages)
     {
-      int i;
-      PIXA *pa = jbDataRender (data, 0);
-      for (i = 0; i < pa->n; i++)
+      PIXA *templates = extract_templates (store);
+      l_int32 *page_start = component_page_starts (data, pages->num_pages);
+
+      for (i = 0; i < pages->num_pages; i++)
 	{
-	  PIX *pix = pa->pix[i];
+	  PIX *pix = render_templates (data, templates, page_start[i],
+				       page_start[i + 1], data->w, data->h);
 	  char filename[512];
 	  sprintf (filename, "rendered_%05d.png", i);
 	  pixWrite (filename, pix, IFF_PNG);
+	  pixDestroy (&pix);
 	}
+
+      free (page_start);
+      pixaDestroy (&templates);
+    }
+
+  /* Look up each class in the glyph dictionary, if we have one */
+  struct glyph_dict *dict = NULL;
+  int *dict_entries = NULL;
+
+  if (args->dict_dir != NULL)
+    {
+      PIXA *templates = extract_templates (store);
+      struct timespec start;
+      stats_start (&start);
+
+      dict = load_glyph_dict (args->dict_dir);
+      dict_entries =
+	match_dict_classes (dict, templates, args->thresh, args->weight);
+      pixaDestroy (&templates);
+
+      stats_stop (STAGE_DICT, &start, -1);
+    }
+
+  /* OCR each class once, for searchable text */
+  struct ocr_result *ocr = NULL;
+
+  if (args->ocr_lang != NULL)
+    {
+      PIXA *templates = extract_templates (store);
+      ocr = recognize_classes (templates, args->ocr_lang, args->threads);
+      pixaDestroy (&templates);
     }
 
   struct mapping *maps = NULL;
-  int num_fonts = register_mappings (data, &maps);
+  int num_fonts = register_mappings (data, ocr, &maps);
 
+  /* Fonts stay in memory, the tmpdir is only used for debugging */
   char *tmpdirname = NULL;
 
-  if (!args->debug_skip_font_gen)
+  if (args->debug_tmpdir != NULL || args->debug_no_clean_tmpdir)
+    {
+      tmpdirname = make_tmpdir (args->debug_tmpdir);
+    }
+
+  struct font_buffer *font_data = NULL;
+
+  if (args->debug_skip_font_gen)
+    {
+      font_data = load_fonts_from_dir (tmpdirname, num_fonts);
+    }
+  else
+    {
+      struct font_options font_options;
+
+      /* Browsers get compressed web fonts */
+      font_options.format = args->format == OUTPUT_HTML ? "woff2" : "ttf";
+      font_options.tolerance = args->outline_tolerance;
+      font_options.grid = args->outline_grid;
+      font_options.hinting = !args->no_hinting;
+      font_options.measure = args->measure_outlines;
+      font_options.tracer = args->tracer;
+      font_options.alphamax = args->alphamax;
+      font_options.opttolerance = args->opttolerance;
+      /* Fonts of an update need names the book doesn't use yet */
+      font_options.first_font = book != NULL ? book->size : 0;
+
+      struct timespec font_start;
+      struct timespec font_end;
+      clock_gettime (CLOCK_MONOTONIC, &font_start);
+
+      font_data = generate_fonts (data, store, maps, num_fonts, tmpdirname,
+				  dict, dict_entries, &font_options);
+
+      /* Each merged class is a glyph that didn't need making */
+      clock_gettime (CLOCK_MONOTONIC, &font_end);
+      if (num_merged > 0 && data->nclass > 0)
+	{
+	  double seconds = (font_end.tv_sec - font_start.tv_sec) +
+	    (font_end.tv_nsec - font_start.tv_nsec) / 1e9;
+	  printf ("Consolidation saved about %.1f seconds of font "
+		  "generation\n", seconds * num_merged / data->nclass);
+	}
+
+      if (dict != NULL)
+	{
+	  save_glyph_dict (dict);
+	}
+    }
+
+  if (book != NULL)
+    {
+      int first_page = args->replace_page > 0 ?
+	args->replace_page - 1 : book->num_kids;
+
+      update_pdf (args->update_file, book, first_page, font_data, num_fonts,
+		  pages->num_pages, data, maps, ocr, pictures,
+		  args->debug_draw_borders);
+      destroy_pdf_info (book);
+    }
+  else if (args->format == OUTPUT_HTML)
+    {
+      generate_html (args->outname, font_data, num_fonts, pages->num_pages,
+		     data, maps, pictures);
+    }
+  else if (args->volume_pages > 0 && args->volume_pages < pages->num_pages)
+    {
+      /* Split the book, each volume only embeds the fonts it uses */
+      int num_volumes =
+	(pages->num_pages + args->volume_pages - 1) / args->volume_pages;
+
+      for (i = 0; i < num_volumes; i++)
+	{
+	  int first_page = i * args->volume_pages;
+	  int num_volume_pages = pages->num_pages - first_page;
+	  char *name = volume_name (args->outname, i, num_volumes);
+
+	  if (num_volume_pages > args->volume_pages)
+	    num_volume_pages = args->volume_pages;
+
+	  printf ("Volume %d: pages %d-%d in %s\n", i + 1, first_page + 1,
+		  first_page + num_volume_pages, name);
+
+	  generate_pdf (name, font_data, num_fonts, first_page,
+			num_volume_pages, data, maps, ocr, pictures,
+			args->linearize, args->debug_draw_borders);
+	  free (name);
+	}
+    }
+  else
+    {
+      generate_pdf (args->outname, font_data, num_fonts, 0,
+		    pages->num_pages, data, maps, ocr, pictures,
+		    args->linearize, args->debug_draw_borders);
+    }
+
+  /* Compare what was placed on each page with the page itself */
+  if (args->verify_dir != NULL)
+    {
+      verify_pages (pages, data, store, args->verify_dir,
+		    args->verify_threshold, args->threads);
+    }
+
+  if (args->stats_file != NULL)
+    {
+      write_stats (args->stats_file);
+    }
+
+  if (args->trace_file != NULL)
     {
-      tmpdirname = generate_fonts (data, maps, num_fonts, args->debug_tmpdir);
+      write_trace (args->trace_file);
     }
 
-  generate_pdf (args->outname, tmpdirname, num_fonts, args->num_input_files,
-		data, maps, args->debug_draw_borders);
+  for (i = 0; i < num_fonts; i++)
+    {
+      free (font_data[i].data);
+    }
+  free (font_data);
 
   /* clean up tmpdir */
 
-  if (!args->debug_no_clean_tmpdir)
+  if (tmpdirname != NULL)
     {
-      /* This may not be Windows compatible */
-      if (nftw (tmpdirname, delete_file, 64, FTW_DEPTH | FTW_PHYS) == -1)
+      if (!args->debug_no_clean_tmpdir)
+	{
+	  /* This may not be Windows compatible */
+	  if (nftw (tmpdirname, delete_file, 64, FTW_DEPTH | FTW_PHYS) == -1)
+	    {
+	      error_quit ("Failed to clean up tmpdir.");
+	    }
+	}
+      else
+	{
+	  printf ("Temporary files kept in %s\n", tmpdirname);
+	}
+
+      if (args->debug_tmpdir == NULL)
 	{
-	  error_quit ("Failed to clean up tmpdir.");
+	  free (tmpdirname);
 	}
     }
 
-  if (args->debug_tmpdir == NULL)
+  if (dict != NULL)
     {
-      free (tmpdirname);
+      destroy_glyph_dict (dict);
+      free (dict_entries);
     }
 
+  free (ocr);
   free (maps);
+  destroy_template_store (store);
   jbDataDestroy (&data);
+  destroy_page_source (pages);
+  if (pictures != NULL)
+    {
+      destroy_picture_list (pictures);
+    }
   free (args->input_files);
   free (args);
   return 0;
@@ -133,14 +405,62 @@ print_help ()
           "Usage: smoothscan [debug-options] [options] -o output.pdf inputs\n"
           "\n"
 	  "Please read the man page for more in depth information.\n"
-	  "inputs is the list of 1bpp TIFF files, one file per page\n"
+	  "inputs is the list of image files. Multi-page TIFFs give one\n"
+	  "page per image, and - reads the images from stdin.\n"
           "\n"
 	  "Regular Options:\n"
 	  "    -o, --output FILE : Place the output into FILE.\n"
+	  "    --format FORMAT\n"
+	  "        Write a pdf (default), or html: a directory FILE of web pages.\n"
+	  "    --profile NAME\n"
+	  "        Trade quality for speed with draft, standard (default) or archival.\n"
 	  "    -t, --thresh VALUE\n"
 	  "        Specify the threshold value [0.40 - 0.98], Default 0.85.\n"
 	  "    -w, --weight VALUE\n"
 	  "        Specify the weight value [0.0 - 1.0], Default 0.5.\n"
+	  "    --auto-tune\n"
+	  "        Pick the threshold and weight by trying them on sample pages.\n"
+	  "    --tune-target PERCENT\n"
+	  "        Most substituted symbols --auto-tune accepts, Default 0.5.\n"
+	  "    --consolidate VALUE\n"
+	  "        Merge classes whose averaged symbols correlate above VALUE.\n"
+	  "    -d, --dict DIR\n"
+	  "        Reuse and extend the glyph dictionary stored in DIR.\n"
+	  "    --binarize METHOD\n"
+	  "        Binarize gray and color pages with sauvola (default), otsu or none.\n"
+	  "    --mixed\n"
+	  "        Keep photos and halftones as images, only vectorize the text.\n"
+	  "    --update BOOK\n"
+	  "        Add the pages to BOOK, a pdf made with --dict, instead of -o.\n"
+	  "    --replace N\n"
+	  "        With --update, the pages replace as many book pages from page N.\n"
+	  "    --linearize\n"
+	  "        Write a linearized (fast web view) pdf, with qpdf.\n"
+	  "    --volume-pages N\n"
+	  "        Split the output into volumes of N pages, FILE-01.pdf and on.\n"
+	  "    --outline-tolerance UNITS\n"
+	  "        Simplify glyph outlines until they are off by up to UNITS/1000 em.\n"
+	  "    --outline-grid UNITS\n"
+	  "        Snap outline points to a grid of UNITS/1000 em, Default 1.\n"
+	  "    --no-hinting, --hinting\n"
+	  "        Leave out or add TrueType hinting. Leaving it out gives smaller fonts.\n"
+	  "    --tracer TRACER\n"
+	  "        Trace glyphs with potrace, or pixels: fast, unsmoothed outlines.\n"
+	  "    --ocr LANG\n"
+	  "        OCR each symbol with Tesseract language LANG, for searchable text.\n"
+	  "    --template-memory MB\n"
+	  "        Keep templates past MB megabytes in a temporary file, 0 for no limit.\n"
+	  "        Default 1024.\n"
+	  "    -j, --threads N\n"
+	  "        Use N threads, Default is the number of processors.\n"
+	  "    --verify DIR\n"
+	  "        Check the output against the input pages, with a report in DIR.\n"
+	  "    --verify-threshold VALUE\n"
+	  "        Flag symbols off by more than VALUE [0.0 - 1.0], Default 0.3.\n"
+	  "    --stats FILE\n"
+	  "        Write stage times, memory use and counters to FILE as JSON.\n"
+	  "    --trace FILE\n"
+	  "        Write a Chrome trace of every stage to FILE.\n"
 	  "    -h, --help\n"
 	  "        Display basic usage information.\n"
 	  "    -v, --version\n"
@@ -154,9 +474,9 @@ print_help ()
 	  "    --debug-render-pages\n"
 	  "        Render output to image files in addition to pdf output.\n"
 	  "    --debug-skip-font-gen\n"
-	  "        Skip font generation step. Won't work if tmpdir doesn't already have fonts in it.\n"
+	  "        Skip font generation step. Needs --debug-tmpdir with fonts already in it.\n"
 	  "    --debug-no-clean-tmpdir\n"
-	  "        Don't delete temporary files from tmpdir when processing is done.\n"
+	  "        Keep glyph images and fonts in a tmpdir when processing is done.\n"
 	  "\n"
 	  "Report bugs to nate@natecraun.net or on the Github bug tracker\n"
 	  "Smoothscan homepage: <https://natecraun.net/projects/smoothscan/>\n"
@@ -242,30 +562,22 @@ file_exists (const char *filename)
   return (access (filename, R_OK) != -1);
 }
 
-
-void
-create_font_from_dir (const char *dirname, const char *fontname, int latticeh,
-		      int latticew, int fontnum)
+void *
+realloc_guarded (void *ptr, size_t size)
 {
-  /* Call python from here */
-  int commandlen =
-    strlen ("smoothscan-fontgen.py") + 1 + strlen (dirname) + 1 +
-    strlen (fontname) + 1 + num_digits (latticeh) + 1 +
-    num_digits (latticew) + 1 + num_digits (fontnum);
+  void *vptr = realloc (ptr, size);
 
-  char *command = malloc_guarded (commandlen + 1);
-  sprintf (command, "smoothscan-fontgen.py %s %s %d %d %d", dirname,
-	   fontname, latticeh, latticew, fontnum);
-  system (command);
-  free (command);
-}
+  if (vptr == NULL)
+    {
+      error_quit ("Out of memory.");
+    }
 
+  return vptr;
+}
 
-char*
-generate_fonts (const JBDATA * data, const struct mapping *maps,
-		int num_fonts, char *dir)
+char *
+make_tmpdir (char *dir)
 {
-  int dirnamelen = 0;
   char *dirname = NULL;
 
   if (dir == NULL)
@@ -285,9 +597,7 @@ generate_fonts (const JBDATA * data, const struct mapping *maps,
       int tmpdirlen = strlen (tmpdir);
       int suffixlen = strlen (suffix);
 
-      dirnamelen = tmpdirlen + suffixlen + 1;
-
-      dirname = malloc_guarded (dirnamelen + 1);
+      dirname = malloc_guarded (tmpdirlen + suffixlen + 1 + 1);
 
       sprintf (dirname, "%s/%s", tmpdir, suffix);
 
@@ -306,307 +616,4689 @@ generate_fonts (const JBDATA * data, const struct mapping *maps,
 	    }
 	}
       dirname = dir;
-      dirnamelen = strlen (dir);
     }
 
-  int i;
+  return dirname;
+}
 
-  PIXA *templates =
-    pixaCreateFromPix (data->pix, data->nclass, data->latticew,
-		       data->latticeh);
+pid_t
+start_font_generator (int latticeh, int latticew, int fontnum,
+		      const struct font_options *options, FILE ** in,
+		      int *out_fd)
+{
+  int to_child[2];
+  int from_child[2];
 
-  if (templates == NULL)
+  if (pipe (to_child) == -1 || pipe (from_child) == -1)
     {
-      error_quit ("Could not create templates from JBDATA.");
+      error_quit ("Could not create pipes to the font generator.");
     }
 
-  /* Create a temp dir for each font */
-  char **fontdirnames = malloc_guarded (num_fonts * sizeof (char *));
-  int *fontdirlens = malloc_guarded (num_fonts * sizeof (int *));
-
-  for (i = 0; i < num_fonts; i++)
+  char latticeh_str[16];
+  char latticew_str[16];
+  char fontnum_str[16];
+  sprintf (latticeh_str, "%d", latticeh);
+  sprintf (latticew_str, "%d", latticew);
+  sprintf (fontnum_str, "%d", fontnum);
+
+  char tolerance_str[32];
+  char grid_str[16];
+  char alphamax_str[32];
+  char opttolerance_str[32];
+  sprintf (tolerance_str, "%g", options->tolerance);
+  sprintf (grid_str, "%d", options->grid);
+  sprintf (alphamax_str, "%g", options->alphamax);
+  sprintf (opttolerance_str, "%g", options->opttolerance);
+
+  int optimize = options->tolerance > 0 || options->grid > 1
+    || !options->hinting;
+
+  const char *argv[24];
+  int argc = 0;
+
+  argv[argc++] = "smoothscan-fontgen.py";
+  argv[argc++] = "--tracer";
+  argv[argc++] = options->tracer;
+  argv[argc++] = "--alphamax";
+  argv[argc++] = alphamax_str;
+  argv[argc++] = "--opttolerance";
+  argv[argc++] = opttolerance_str;
+  if (optimize)
     {
-      /* 1 for / 8 for %08d */
-      fontdirlens[i] = dirnamelen + 1 + 8;
-      fontdirnames[i] = malloc_guarded (fontdirlens[i] + 1);
+      argv[argc++] = "--tolerance";
+      argv[argc++] = tolerance_str;
+      argv[argc++] = "--grid";
+      argv[argc++] = grid_str;
+      if (!options->hinting)
+	argv[argc++] = "--no-hinting";
+      /*
+         So we can tell what the optimization saved. That takes a
+         second, hinted font, so only when it was asked for.
+       */
+      if (options->measure)
+	argv[argc++] = "--measure";
+    }
+  argv[argc++] = "-";
+  argv[argc++] = latticeh_str;
+  argv[argc++] = latticew_str;
+  argv[argc++] = fontnum_str;
+  argv[argc++] = options->format;
+  argv[argc] = NULL;
 
-      sprintf (fontdirnames[i], "%s/%08d", dirname, i);
+  /* This part probably won't port over to Windows as well */
+  pid_t pid = fork ();
 
-      if (mkdir (fontdirnames[i], 0700) == -1)
-	{
-	  error_quit ("Failed to create font temp directory.");
-	}
+  if (pid == -1)
+    {
+      error_quit ("Could not start the font generator.");
+    }
+
+  if (pid == 0)
+    {
+      dup2 (to_child[0], STDIN_FILENO);
+      dup2 (from_child[1], STDOUT_FILENO);
+      close (to_child[0]);
+      close (to_child[1]);
+      close (from_child[0]);
+      close (from_child[1]);
+
+      execvp ("smoothscan-fontgen.py", (char *const *) argv);
+
+      fprintf (stderr, "Error: Could not run smoothscan-fontgen.py: %s\n",
+	       strerror (errno));
+      _exit (127);
     }
 
+  close (to_child[0]);
+  close (from_child[1]);
 
-  for (i = 0; i < templates->n; i++)
+  *in = fdopen (to_child[1], "w");
+  if (*in == NULL)
     {
-      l_int32 iclass;
-      l_int32 x;
-      l_int32 y;
+      error_quit ("Could not open pipe to the font generator.");
+    }
 
-      numaGetIValue (data->naclass, i, &iclass);
-      ptaGetIPt (data->ptaul, i, &x, &y);
-      PIX *pix_clone = pixaGetPix (templates, i, L_CLONE);	/* the template */
-      double wp1 = pixGetWidth (pix_clone);
-      double hp1 = pixGetHeight (pix_clone);
-      PIX *pix_padded =
-	pixAddBorderGeneral (pix_clone, 0, data->latticew - wp1, 0,
-			     data->latticeh - hp1, 0);
+  *out_fd = from_child[0];
 
-      if (pix_padded == NULL)
-	{
-	  error_quit ("Failed to add border to image.");
-	}
+  return pid;
+}
 
-      int fontn = maps[i].font_num;
-      int code_point = maps[i].code_point;
+void
+finish_font_generator (pid_t pid, int out_fd, struct font_buffer *font)
+{
+  size_t capacity = 65536;
+  size_t len = 0;
+  unsigned char *buf = malloc_guarded (capacity);
 
-      /* 1 for '/', 3 for %03d, 4 for '.png' */
-      int filenamelen = fontdirlens[fontn] + 1 + 3 + 4;
-      char *filename = malloc_guarded (filenamelen + 1);
+  while (1)
+    {
+      if (len == capacity)
+	{
+	  capacity *= 2;
+	  buf = realloc_guarded (buf, capacity);
+	}
 
-      sprintf (filename, "%s/%03d.png", fontdirnames[fontn], code_point);
+      ssize_t n = read (out_fd, buf + len, capacity - len);
 
-      if (pixWrite (filename, pix_padded, IFF_PNG) == 1)
+      if (n == -1)
 	{
-	  printf ("pixWrite failed to write %s.\n", filename);
-	  error_quit ("Could not write to file.");
+	  if (errno == EINTR)
+	    continue;
+	  error_quit ("Could not read from the font generator.");
 	}
 
-      pixDestroy (&pix_clone);
-      pixDestroy (&pix_padded);
-      free (filename);
-    }
+      if (n == 0)
+	break;
 
-  pixaDestroy (&templates);
+      len += n;
+    }
 
-  /* This part probably won't port over to Windows as well */
+  close (out_fd);
 
-  /* TODO: parallelize this */
-  for (i = 0; i < num_fonts; i++)
+  int status;
+  if (waitpid (pid, &status, 0) == -1 || !WIFEXITED (status)
+      || WEXITSTATUS (status) != 0)
     {
-      /* 1 for '/', 8 for %08d, 4 for '.ttf' */
-      int fontnamelen = dirnamelen + 1 + 8 + 4;
-      char *fontnamestr = malloc_guarded (fontnamelen + 1);
-      sprintf (fontnamestr, "%s/%08d.ttf", dirname, i);
-
-      create_font_from_dir (fontdirnames[i], fontnamestr, data->latticeh,
-			    data->latticew, i);
-      free (fontnamestr);
+      error_quit ("Font generation failed.");
     }
 
-  /* clean up */
-  for (i = 0; i < num_fonts; i++)
+  /*
+     The output is a "font <size> <format> <full size>" line, followed
+     by the font itself. The full size is 0 unless the outlines were
+     optimized.
+   */
+  unsigned char *newline = memchr (buf, '\n', len);
+  unsigned long size;
+  unsigned long full_size;
+
+  if (newline == NULL
+      || sscanf ((char *) buf, "font %lu %7s %lu", &size, font->format,
+		 &full_size) != 3 || size != len - (newline + 1 - buf))
     {
-      free (fontdirnames[i]);
+      error_quit ("The font generator returned a damaged font.");
     }
-  free (fontdirnames);
-  free (fontdirlens);
 
-  return dirname;
+  font->full_size = full_size;
+
+  font->size = size;
+  font->data = malloc_guarded (size);
+  memcpy (font->data, newline + 1, size);
+
+  free (buf);
 }
 
-void
-generate_pdf (const char *outname, const char *tmpdirname, int num_fonts,
-	      int num_input_files, const JBDATA * data,
-	      const struct mapping *maps, int debug_draw_borders)
+/*
+  Write pix to the font generator as hex, one line per row, with the
+  leftmost pixel in the most significant bit.
+*/
+static void
+write_glyph_bitmap (FILE * out, PIX * pix)
 {
-  int i, j;
-  /* Create the pdf document */
-  l_int32 ncomp = numaGetCount (data->naclass);
-  HPDF_Doc pdf = HPDF_New (pdf_error_handler, NULL);
+  l_int32 x, y;
+  l_int32 w = pixGetWidth (pix);
+  l_int32 h = pixGetHeight (pix);
+  l_int32 wpl = pixGetWpl (pix);
+  l_uint32 *data = pixGetData (pix);
 
-  HPDF_SetCompressionMode (pdf, HPDF_COMP_ALL);
-  HPDF_Font *fonts = malloc_guarded (num_fonts * (sizeof (HPDF_Font)));
+  /* Bits past the right edge aren't guaranteed to be clear */
+  unsigned int lastmask = (0xff00 >> (((w - 1) & 7) + 1)) & 0xff;
+  l_int32 nbytes = (w + 7) / 8;
 
-  int dirlen = strlen (tmpdirname);
-
-  /* Load the fonts */
-  for (i = 0; i < num_fonts; i++)
+  for (y = 0; y < h; y++)
     {
-      /* 1 for '/', 8 for %08d, 4 for '.ttf' */
-      int fontlen = dirlen + 1 + 8 + 4;
-      char *font_tfname = malloc_guarded (fontlen + 1);
-      sprintf (font_tfname, "%s/%08d.ttf", tmpdirname, i);
+      l_uint32 *line = data + y * wpl;
 
-      const char *font_name =
-	HPDF_LoadTTFontFromFile (pdf, font_tfname, HPDF_TRUE);
-      fonts[i] = HPDF_GetFont (pdf, font_name, "KOI8-R");
-      free (font_tfname);
-    }
+      for (x = 0; x < nbytes; x++)
+	{
+	  unsigned int byte = GET_DATA_BYTE (line, x);
 
-  for (j = 0; j < num_input_files; j++)
-    {
-      /* Add page to document */
-      HPDF_Page pg = HPDF_AddPage (pdf);
+	  if (x == nbytes - 1)
+	    byte &= lastmask;
 
-      HPDF_Page_SetWidth (pg, data->w);
-      HPDF_Page_SetHeight (pg, data->h);
+	  fprintf (out, "%02x", byte);
+	}
 
-      /* TODO: Boost efficiency by making startcomp go to the next page on the next iteration */
-      int start_comp = 0;
+      fputc ('\n', out);
+    }
+}
 
-      for (i = start_comp; i < ncomp; i++)
-	{
-	  l_int32 ipage;
-	  l_int32 iclass;
-	  l_int32 x;
-	  l_int32 y;
+struct font_buffer *
+load_fonts_from_dir (const char *dirname, int num_fonts)
+{
+  int i;
+  struct font_buffer *fonts =
+    malloc_guarded (num_fonts * sizeof (struct font_buffer));
 
-	  numaGetIValue (data->napage, i, &ipage);
+  for (i = 0; i < num_fonts; i++)
+    {
+      /* 1 for '/', 8 for %08d, 4 for '.ttf' */
+      char *fontname = malloc_guarded (strlen (dirname) + 1 + 8 + 4 + 1);
+      sprintf (fontname, "%s/%08d.ttf", dirname, i);
 
-	  if (ipage != j)
-	    continue;
+      fonts[i].data = l_binaryRead (fontname, &fonts[i].size);
+      strcpy (fonts[i].format, "ttf");
+      fonts[i].full_size = 0;
 
-	  numaGetIValue (data->naclass, i, &iclass);
-	  ptaGetIPt (data->ptaul, i, &x, &y);
+      if (fonts[i].data == NULL)
+	{
+	  printf ("Can't read %s.\n", fontname);
+	  error_quit ("Could not load font from tmpdir.");
+	}
 
-	  /*double left = x;
-	     double top = data->h - y;
-	     double right = x + data->latticew;
-	     double bottom = data->h - (y + data->latticeh); */
+      free (fontname);
+    }
 
-	  char text[2];
-	  text[0] = maps[iclass].code_point;
-	  text[1] = '\0';
+  return fonts;
+}
 
-	  HPDF_Font font = fonts[maps[iclass].font_num];
+struct template_store *
+create_template_store (size_t memory_limit)
+{
+  struct template_store *store =
+    malloc_guarded (sizeof (struct template_store));
+
+  store->n = 0;
+  store->capacity = 256;
+  store->entries =
+    malloc_guarded (store->capacity * sizeof (struct template_entry));
+  store->memory_limit = memory_limit;
+  store->size = 0;
+  store->bits_capacity = 4096;
+  store->bits = malloc_guarded (store->bits_capacity);
+  store->fd = -1;
+  store->mapped = 0;
+
+  return store;
+}
 
-	  HPDF_Page_BeginText (pg);
-	  double fontsize = 100;
+/*
+  Move what is packed so far to an unlinked temporary file. Everything
+  packed after this is written straight to it.
+*/
+static void
+spill_template_store (struct template_store *store)
+{
+  char suffix[] = "smoothscan_templates_XXXXXX";
+  char *tmpdir = getenv ("TMPDIR");
 
-	  if (fontsize > 300)
-	    {
-	      error_quit ("This is a known bug.\n"
-			  "libharu can't handle fontsizes bigger than 300, which is what is being requested here.\n"
-			  "Please report this bug, and the file that produced this error");
-	    }
+  if (tmpdir == NULL)
+    tmpdir = P_tmpdir;
 
-	  HPDF_Page_SetFontAndSize (pg, font, 100);
+  char *filename = malloc_guarded (strlen (tmpdir) + 1 + strlen (suffix) + 1);
+  sprintf (filename, "%s/%s", tmpdir, suffix);
 
-	  HPDF_Page_MoveTextPos (pg, x, (data->h - y) - data->latticeh);
-	  HPDF_Page_ShowText (pg, text);
+  store->fd = mkstemp (filename);
 
-	  HPDF_Page_EndText (pg);
+  if (store->fd == -1)
+    {
+      error_quit ("Failed to create template spill file.");
+    }
 
-	  if (debug_draw_borders)
-	    {
-	      HPDF_Page_SetRGBStroke (pg, 1, 0, 0);
-	      /* In this, x, y is the LOWER LEFT, not UPPER LEFT */
-	      HPDF_Page_Rectangle (pg, x, (data->h - y) - data->latticeh,
-				   data->latticew, data->latticeh);
-	      HPDF_Page_Stroke (pg);
-	    }
-	}
+  /* It goes away with us, however we exit */
+  unlink (filename);
+  free (filename);
+
+  if (write (store->fd, store->bits, store->size) != (ssize_t) store->size)
+    {
+      error_quit ("Could not write template spill file.");
     }
 
-  /* Output */
-  HPDF_SaveToFile (pdf, outname);
+  free (store->bits);
+  store->bits = NULL;
+  store->bits_capacity = 0;
 
-  /* Cleanup */
-  HPDF_Free (pdf);
-  free (fonts);
+  printf ("Templates passed %lu MB, keeping them in a temporary file\n",
+	  (unsigned long) (store->memory_limit >> 20));
 }
 
-JBDATA *
-classify_components (int num_input_files, char **input_files, double thresh,
-		     double weight)
+void
+template_store_add (struct template_store *store, PIX * template)
 {
+  l_int32 x, y;
+  PIX *pix = NULL;
+  BOX *box = NULL;
 
-  /* JBCLASSER* classer = jbCorrelationInit(JB_CONN_COMPS, 9999, 9999, thresh, weight); */
-  JBCLASSER *classer =
-    jbCorrelationInitWithoutComponents (JB_CONN_COMPS, 9999, 9999, thresh,
-					weight);
+  if (store->n == store->capacity)
+    {
+      store->capacity *= 2;
+      store->entries = realloc_guarded (store->entries, store->capacity *
+					sizeof (struct template_entry));
+    }
 
-  if (classer == NULL)
+  struct template_entry *entry = &store->entries[store->n];
+
+  if (pixClipToForeground (template, &pix, &box) == 1 || pix == NULL)
     {
-      error_quit ("Unable to create leptonica JBCLASSER.");
+      /* Keep a blank template so the class indices still line up */
+      pix = pixCreate (1, 1, 1);
+      box = boxCreate (0, 0, 1, 1);
     }
 
-  int i;
+  boxGetGeometry (box, &entry->x, &entry->y, &entry->w, &entry->h);
+  entry->offset = store->size;
 
-  for (i = 0; i < num_input_files; i++)
+  l_int32 nbytes = (entry->w + 7) / 8;
+  size_t size = (size_t) nbytes * entry->h;
+  l_int32 wpl = pixGetWpl (pix);
+  l_uint32 *data = pixGetData (pix);
+
+  if (store->fd == -1 && store->memory_limit > 0
+      && store->size + size > store->memory_limit)
     {
-      PIX *page = pixRead (input_files[i]);
+      spill_template_store (store);
+    }
+
+  unsigned char *packed;
+
+  if (store->fd == -1)
+    {
+      if (store->size + size > store->bits_capacity)
+	{
+	  while (store->size + size > store->bits_capacity)
+	    store->bits_capacity *= 2;
+	  store->bits = realloc_guarded (store->bits, store->bits_capacity);
+	}
+      packed = store->bits + store->size;
+    }
+  else
+    {
+      packed = malloc_guarded (size > 0 ? size : 1);
+    }
+
+  /* Bits past the right edge aren't guaranteed to be clear */
+  unsigned int lastmask = (0xff00 >> (((entry->w - 1) & 7) + 1)) & 0xff;
+
+  for (y = 0; y < entry->h; y++)
+    {
+      l_uint32 *line = data + y * wpl;
+
+      for (x = 0; x < nbytes; x++)
+	{
+	  unsigned int byte = GET_DATA_BYTE (line, x);
+
+	  if (x == nbytes - 1)
+	    byte &= lastmask;
+
+	  packed[y * nbytes + x] = byte;
+	}
+    }
+
+  if (store->fd != -1)
+    {
+      if (write (store->fd, packed, size) != (ssize_t) size)
+	{
+	  error_quit ("Could not write template spill file.");
+	}
+      free (packed);
+    }
+
+  store->size += size;
+  store->n++;
+
+  boxDestroy (&box);
+  pixDestroy (&pix);
+}
+
+void
+finish_template_store (struct template_store *store)
+{
+  if (store->fd == -1 || store->size == 0)
+    return;
+
+  store->bits = mmap (NULL, store->size, PROT_READ, MAP_PRIVATE,
+		      store->fd, 0);
+
+  if (store->bits == MAP_FAILED)
+    {
+      error_quit ("Could not map template spill file.");
+    }
+
+  store->mapped = 1;
+}
+
+PIX *
+template_store_get (const struct template_store *store, int i, l_int32 * x,
+		    l_int32 * y)
+{
+  l_int32 xx, yy;
+  const struct template_entry *entry = &store->entries[i];
+  l_int32 nbytes = (entry->w + 7) / 8;
+  const unsigned char *packed = store->bits + entry->offset;
+  PIX *pix = pixCreate (entry->w, entry->h, 1);
+  l_int32 wpl = pixGetWpl (pix);
+  l_uint32 *data = pixGetData (pix);
+
+  for (yy = 0; yy < entry->h; yy++)
+    {
+      l_uint32 *line = data + yy * wpl;
+
+      for (xx = 0; xx < nbytes; xx++)
+	{
+	  SET_DATA_BYTE (line, xx, packed[yy * nbytes + xx]);
+	}
+    }
+
+  if (x != NULL)
+    *x = entry->x;
+  if (y != NULL)
+    *y = entry->y;
+
+  return pix;
+}
+
+void
+destroy_template_store (struct template_store *store)
+{
+  if (store->mapped)
+    munmap (store->bits, store->size);
+  else
+    free (store->bits);
+
+  if (store->fd != -1)
+    close (store->fd);
+
+  free (store->entries);
+  free (store);
+}
+
+JBDATA *
+save_classes (JBCLASSER * classer, size_t memory_limit,
+	      struct template_store **store)
+{
+  int i;
+  l_int32 maxw, maxh;
+
+  *store = create_template_store (memory_limit);
+
+  for (i = 0; i < classer->nclass; i++)
+    {
+      template_store_add (*store, classer->pixat->pix[i]);
+    }
+
+  finish_template_store (*store);
+
+  /*
+     Everything jbDataSave fills in but the lattice image. jbDataDestroy
+     frees it with leptonica's free, which is the standard one.
+   */
+  JBDATA *data = calloc (1, sizeof (JBDATA));
+
+  if (data == NULL)
+    {
+      error_quit ("Out of memory.");
+    }
+
+  pixaSizeRange (classer->pixat, NULL, NULL, &maxw, &maxh);
+
+  data->pix = NULL;
+  data->npages = classer->npages;
+  data->w = classer->w;
+  data->h = classer->h;
+  data->nclass = classer->nclass;
+  data->latticew = maxw + 1;
+  data->latticeh = maxh + 1;
+  data->naclass = numaClone (classer->naclass);
+  data->napage = numaClone (classer->napage);
+  data->ptaul = ptaClone (classer->ptaul);
+
+  return data;
+}
+
+PIXA *
+extract_templates (const struct template_store *store)
+{
+  int i;
+  struct timespec start;
+  stats_start (&start);
+
+  PIXA *templates = pixaCreate (store->n);
+
+  for (i = 0; i < store->n; i++)
+    {
+      l_int32 x, y;
+      PIX *pix = template_store_get (store, i, &x, &y);
+
+      pixaAddPix (templates, pix, L_INSERT);
+      pixaAddBox (templates, boxCreate (x, y, pixGetWidth (pix),
+					pixGetHeight (pix)), L_INSERT);
+    }
+
+  stats_stop (STAGE_TEMPLATES, &start, -1);
+
+  return templates;
+}
+
+char *
+dict_outline_name (const struct glyph_dict *dict, int entry)
+{
+  /* 1 for '/', 8 for %08d, 8 for '.outline' */
+  char *name = malloc_guarded (strlen (dict->dirname) + 1 + 8 + 8 + 1);
+  sprintf (name, "%s/%08d.outline", dict->dirname, entry);
+  return name;
+}
+
+/*
+  Append pix to the dictionary, along with the area and centroid used
+  to compare against it.
+*/
+static void
+add_dict_entry (struct glyph_dict *dict, PIX * pix, l_int32 * sumtab,
+		l_int32 * centtab)
+{
+  l_int32 area;
+  l_float32 x;
+  l_float32 y;
+
+  pixCountPixels (pix, &area, sumtab);
+  pixCentroid (pix, centtab, sumtab, &x, &y);
+
+  numaAddNumber (dict->naarea, area);
+  ptaAddPt (dict->ptacent, x, y);
+}
+
+struct glyph_dict *
+load_glyph_dict (const char *dirname)
+{
+  int i;
+  struct glyph_dict *dict = malloc_guarded (sizeof (struct glyph_dict));
+
+  dict->dirname = malloc_guarded (strlen (dirname) + 1);
+  strcpy (dict->dirname, dirname);
+
+  if (mkdir (dirname, 0700) == -1)
+    {
+      if (errno != EEXIST)
+	{
+	  error_quit ("Couldn't make glyph dictionary directory.");
+	}
+    }
+
+  /* 1 for '/', 12 for 'templates.pa' */
+  char *filename = malloc_guarded (strlen (dirname) + 1 + 12 + 1);
+  sprintf (filename, "%s/templates.pa", dirname);
+
+  if (file_exists (filename))
+    {
+      dict->templates = pixaRead (filename);
+
+      if (dict->templates == NULL)
+	{
+	  printf ("Problem with glyph dictionary %s\n", filename);
+	  error_quit ("Unable to read glyph dictionary.");
+	}
+    }
+  else
+    {
+      dict->templates = pixaCreate (0);
+    }
+
+  free (filename);
+
+  dict->num_loaded = pixaGetCount (dict->templates);
+  dict->naarea = numaCreate (dict->num_loaded);
+  dict->ptacent = ptaCreate (dict->num_loaded);
+
+  l_int32 *sumtab = makePixelSumTab8 ();
+  l_int32 *centtab = makePixelCentroidTab8 ();
+
+  for (i = 0; i < dict->num_loaded; i++)
+    {
+      add_dict_entry (dict, dict->templates->pix[i], sumtab, centtab);
+    }
+
+  free (sumtab);
+  free (centtab);
+
+  printf ("Loaded %d glyphs from dictionary %s\n", dict->num_loaded,
+	  dirname);
+
+  return dict;
+}
+
+void
+save_glyph_dict (const struct glyph_dict *dict)
+{
+  /* 1 for '/', 12 for 'templates.pa' */
+  char *filename = malloc_guarded (strlen (dict->dirname) + 1 + 12 + 1);
+  sprintf (filename, "%s/templates.pa", dict->dirname);
+
+  if (pixaWrite (filename, dict->templates) == 1)
+    {
+      printf ("pixaWrite failed to write %s.\n", filename);
+      error_quit ("Could not write glyph dictionary.");
+    }
+
+  free (filename);
+}
+
+void
+destroy_glyph_dict (struct glyph_dict *dict)
+{
+  pixaDestroy (&dict->templates);
+  numaDestroy (&dict->naarea);
+  ptaDestroy (&dict->ptacent);
+  free (dict->dirname);
+  free (dict);
+}
+
+int *
+match_dict_classes (struct glyph_dict *dict, PIXA * templates, double thresh,
+		    double weight)
+{
+  int i, j;
+  int num_reused = 0;
+  long num_comparisons = 0;
+  int n = pixaGetCount (templates);
+  int *entries = malloc_guarded (n * sizeof (int));
+
+  l_int32 *sumtab = makePixelSumTab8 ();
+  l_int32 *centtab = makePixelCentroidTab8 ();
+
+  for (i = 0; i < n; i++)
+    {
+      PIX *pix = templates->pix[i];
+      l_int32 w = pixGetWidth (pix);
+      l_int32 h = pixGetHeight (pix);
+      l_int32 area;
+      l_float32 x;
+      l_float32 y;
+
+      pixCountPixels (pix, &area, sumtab);
+      pixCentroid (pix, centtab, sumtab, &x, &y);
+
+      entries[i] = -1;
+
+      /* Only entries traced in earlier runs have an outline to reuse */
+      for (j = 0; j < dict->num_loaded && entries[i] == -1; j++)
+	{
+	  PIX *entry = dict->templates->pix[j];
+	  l_int32 entry_area;
+	  l_float32 entry_x;
+	  l_float32 entry_y;
+	  l_float32 score;
+
+	  /* Same size tolerance leptonica's classifier uses */
+	  if (abs (pixGetWidth (entry) - w) > 2
+	      || abs (pixGetHeight (entry) - h) > 2)
+	    continue;
+
+	  numaGetIValue (dict->naarea, j, &entry_area);
+	  ptaGetPt (dict->ptacent, j, &entry_x, &entry_y);
+
+	  /*
+	     Thick glyphs correlate well with almost anything, so raise
+	     the threshold with the entry's foreground fraction, the
+	     same way the classifier applies its weight.
+	   */
+	  double threshold = thresh + (1.0 - thresh) * weight *
+	    entry_area / (double) (pixGetWidth (entry) *
+				   pixGetHeight (entry));
+
+	  pixCorrelationScore (pix, entry, area, entry_area, x - entry_x,
+			       y - entry_y, 2, 2, sumtab, &score);
+	  num_comparisons++;
+
+	  if (score < threshold)
+	    continue;
+
+	  /* The entry is useless if its glyph was never traced */
+	  char *outline = dict_outline_name (dict, j);
+	  if (file_exists (outline))
+	    {
+	      entries[i] = j;
+	      num_reused++;
+	    }
+	  free (outline);
+	}
+
+      if (entries[i] == -1)
+	{
+	  entries[i] = pixaGetCount (dict->templates);
+	  pixaAddPix (dict->templates, pix, L_CLONE);
+	  add_dict_entry (dict, pix, sumtab, centtab);
+	}
+    }
+
+  free (sumtab);
+  free (centtab);
+
+  printf ("%d of %d classes found in glyph dictionary\n", num_reused, n);
+
+  stats_count (COUNTER_DICT_COMPARISONS, num_comparisons);
+  stats_count (COUNTER_DICT_MATCHES, num_reused);
+
+  return entries;
+}
+
+#ifdef HAVE_TESSERACT
+/* One OCR thread's share of the templates */
+struct ocr_job
+{
+  PIXA *templates;
+  const char *lang;
+  int start;
+  int end;
+  struct ocr_result *results;
+};
+
+/*
+  Keep the characters of Tesseract's UTF-8 text, without the
+  whitespace it puts around them. Malformed text, or text that is too
+  long to be one glyph, leaves result unrecognized.
+*/
+static void
+parse_ocr_text (const char *text, struct ocr_result *result)
+{
+  const unsigned char *p = (const unsigned char *) text;
+
+  result->len = 0;
+
+  while (*p != '\0')
+    {
+      l_uint32 c;
+      int extra;
+
+      if (*p < 0x80)
+	{
+	  c = *p;
+	  extra = 0;
+	}
+      else if ((*p & 0xe0) == 0xc0)
+	{
+	  c = *p & 0x1f;
+	  extra = 1;
+	}
+      else if ((*p & 0xf0) == 0xe0)
+	{
+	  c = *p & 0x0f;
+	  extra = 2;
+	}
+      else if ((*p & 0xf8) == 0xf0)
+	{
+	  c = *p & 0x07;
+	  extra = 3;
+	}
+      else
+	{
+	  result->len = 0;
+	  return;
+	}
+
+      p++;
+
+      for (; extra > 0; extra--, p++)
+	{
+	  if ((*p & 0xc0) != 0x80)
+	    {
+	      result->len = 0;
+	      return;
+	    }
+	  c = (c << 6) | (*p & 0x3f);
+	}
+
+      if (c <= ' ')
+	continue;
+
+      if (result->len == OCR_MAX_CHARS)
+	{
+	  result->len = 0;
+	  return;
+	}
+
+      result->chars[result->len++] = c;
+    }
+}
+
+static void *
+recognize_class_range (void *arg)
+{
+  struct ocr_job *job = arg;
+  int i;
+  struct timespec start;
+  stats_start (&start);
+
+  TessBaseAPI *api = TessBaseAPICreate ();
+
+  if (TessBaseAPIInit3 (api, NULL, job->lang) != 0)
+    {
+      error_quit ("Unable to start Tesseract. "
+		  "Is the data for the --ocr language installed?");
+    }
+
+  TessBaseAPISetPageSegMode (api, PSM_SINGLE_CHAR);
+
+  for (i = job->start; i < job->end; i++)
+    {
+      /*
+         Tesseract wants some white space around the character. Use
+         the pix directly, cloning it would race on the refcount.
+       */
+      PIX *pix = job->templates->pix[i];
+      PIX *padded = pixAddBorder (pix, pixGetHeight (pix) / 2 + 4, 0);
+
+      TessBaseAPISetImage2 (api, padded);
+      TessBaseAPISetSourceResolution (api, 300);
+
+      char *text = TessBaseAPIGetUTF8Text (api);
+
+      job->results[i].len = 0;
+
+      if (text != NULL && TessBaseAPIMeanTextConf (api) >= OCR_MIN_CONFIDENCE)
+	{
+	  parse_ocr_text (text, &job->results[i]);
+	}
+
+      TessDeleteText (text);
+      pixDestroy (&padded);
+    }
+
+  TessBaseAPIEnd (api);
+  TessBaseAPIDelete (api);
+
+  stats_stop (STAGE_OCR, &start, job->start);
+
+  return NULL;
+}
+#endif
+
+struct ocr_result *
+recognize_classes (PIXA * templates, const char *lang, int num_threads)
+{
+#ifdef HAVE_TESSERACT
+  int i;
+  int n = pixaGetCount (templates);
+  int num_recognized = 0;
+  struct ocr_result *results =
+    malloc_guarded ((n > 0 ? n : 1) * sizeof (struct ocr_result));
+
+  if (num_threads > n)
+    num_threads = n;
+  if (num_threads < 1)
+    num_threads = 1;
+
+  struct ocr_job *jobs = malloc_guarded (num_threads * sizeof (struct ocr_job));
+  pthread_t *threads = malloc_guarded (num_threads * sizeof (pthread_t));
+
+  for (i = 0; i < num_threads; i++)
+    {
+      jobs[i].templates = templates;
+      jobs[i].lang = lang;
+      jobs[i].start = (int) ((long) n * i / num_threads);
+      jobs[i].end = (int) ((long) n * (i + 1) / num_threads);
+      jobs[i].results = results;
+
+      if (pthread_create (&threads[i], NULL, recognize_class_range,
+			  &jobs[i]) != 0)
+	{
+	  error_quit ("Unable to create OCR thread.");
+	}
+    }
+
+  for (i = 0; i < num_threads; i++)
+    {
+      pthread_join (threads[i], NULL);
+    }
+
+  free (jobs);
+  free (threads);
+
+  for (i = 0; i < n; i++)
+    {
+      if (results[i].len > 0)
+	num_recognized++;
+    }
+
+  printf ("%d of %d classes recognized by OCR\n", num_recognized, n);
+  stats_count (COUNTER_OCR_RECOGNIZED, num_recognized);
+
+  return results;
+#else
+  error_quit ("smoothscan was built without Tesseract, so --ocr is not "
+	      "available.");
+  return NULL;
+#endif
+}
+
+/*
+  Write c as the UTF-16BE hex digits of a CMap destination string.
+*/
+static void
+write_utf16_hex (HPDF_Stream stream, l_uint32 c)
+{
+  char buf[16];
+
+  if (c >= 0x10000)
+    {
+      c -= 0x10000;
+      sprintf (buf, "%04X%04X", (unsigned int) (0xd800 + (c >> 10)),
+	       (unsigned int) (0xdc00 + (c & 0x3ff)));
+    }
+  else
+    {
+      sprintf (buf, "%04X", (unsigned int) c);
+    }
+
+  HPDF_Stream_WriteStr (stream, buf);
+}
+
+void
+add_to_unicode (HPDF_Doc pdf, HPDF_Font font, int font_num,
+		const JBDATA * data, const struct mapping *maps,
+		const struct ocr_result *ocr)
+{
+  int i, j;
+  int n = 0;
+  int *classes = malloc_guarded ((data->nclass + 1) * sizeof (int));
+
+  for (i = 0; i < data->nclass; i++)
+    {
+      if (maps[i].used && maps[i].font_num == font_num)
+	classes[n++] = i;
+    }
+
+  /* libharu has no ToUnicode support for these fonts, so add our own */
+  HPDF_Dict cmap = HPDF_DictStream_New (pdf->mmgr, pdf->xref);
+
+  if (cmap == NULL)
+    {
+      error_quit ("Could not create ToUnicode CMap.");
+    }
+
+  if (pdf->compression_mode & HPDF_COMP_TEXT)
+    {
+      cmap->filter = HPDF_STREAM_FILTER_FLATE;
+    }
+
+  HPDF_Stream stream = cmap->stream;
+
+  HPDF_Stream_WriteStr (stream,
+			"/CIDInit /ProcSet findresource begin\n"
+			"12 dict begin\n"
+			"begincmap\n"
+			"/CIDSystemInfo\n"
+			"<< /Registry (Adobe)\n"
+			"/Ordering (UCS)\n"
+			"/Supplement 0\n"
+			">> def\n"
+			"/CMapName /Adobe-Identity-UCS def\n"
+			"/CMapType 2 def\n"
+			"1 begincodespacerange\n"
+			"<00> <FF>\n" "endcodespacerange\n");
+
+  /* A bfchar block may hold at most 100 entries */
+  for (i = 0; i < n; i += 100)
+    {
+      int block = n - i < 100 ? n - i : 100;
+      char buf[32];
+
+      sprintf (buf, "%d beginbfchar\n", block);
+      HPDF_Stream_WriteStr (stream, buf);
+
+      for (j = i; j < i + block; j++)
+	{
+	  const struct mapping *map = &maps[classes[j]];
+	  const struct ocr_result *result = &ocr[classes[j]];
+	  int k;
+
+	  sprintf (buf, "<%02X> <", map->code_point);
+	  HPDF_Stream_WriteStr (stream, buf);
+
+	  if (result->len == 0)
+	    {
+	      write_utf16_hex (stream, 0xfffd);
+	    }
+
+	  for (k = 0; k < result->len; k++)
+	    {
+	      write_utf16_hex (stream, result->chars[k]);
+	    }
+
+	  HPDF_Stream_WriteStr (stream, ">\n");
+	}
+
+      HPDF_Stream_WriteStr (stream, "endbfchar\n");
+    }
+
+  HPDF_Stream_WriteStr (stream,
+			"endcmap\n"
+			"CMapName currentdict /CMap defineresource pop\n"
+			"end\n" "end\n");
+
+  if (HPDF_Dict_Add (font, "ToUnicode", cmap) != HPDF_OK)
+    {
+      error_quit ("Could not add ToUnicode CMap to font.");
+    }
+
+  free (classes);
+}
+
+struct font_buffer *
+generate_fonts (const JBDATA * data, const struct template_store *store,
+		const struct mapping *maps, int num_fonts,
+		const char *tmpdirname,
+		const struct glyph_dict *dict, const int *dict_entries,
+		const struct font_options *options)
+{
+  int i, j;
+  unsigned long total_size = 0;
+  unsigned long total_full_size = 0;
+  struct font_buffer *fonts =
+    malloc_guarded (num_fonts * sizeof (struct font_buffer));
+
+  /* A generator that dies early shouldn't take us down with SIGPIPE */
+  signal (SIGPIPE, SIG_IGN);
+
+  /* TODO: parallelize this */
+  for (i = 0; i < num_fonts; i++)
+    {
+      struct timespec start;
+      stats_start (&start);
+
+      FILE *in;
+      int out_fd;
+      pid_t pid =
+	start_font_generator (data->latticeh, data->latticew,
+			      options->first_font + i, options,
+			      &in, &out_fd);
+
+      /* Keep the glyph images around for inspection in the tmpdir */
+      char *fontdirname = NULL;
+
+      if (tmpdirname != NULL)
+	{
+	  /* 1 for / 8 for %08d */
+	  fontdirname = malloc_guarded (strlen (tmpdirname) + 1 + 8 + 1);
+	  sprintf (fontdirname, "%s/%08d", tmpdirname, i);
+
+	  if (mkdir (fontdirname, 0700) == -1 && errno != EEXIST)
+	    {
+	      error_quit ("Failed to create font temp directory.");
+	    }
+	}
+
+      for (j = 0; j < data->nclass; j++)
+	{
+	  if (maps[j].font_num != i)
+	    continue;
+
+	  int code_point = maps[j].code_point;
+
+	  /* Only one template is unpacked at a time */
+	  l_int32 x;
+	  l_int32 y;
+	  PIX *pix = template_store_get (store, j, &x, &y);
+
+	  /*
+	     Glyphs traced in an earlier run just reuse the stored outline,
+	     moved to where this template sits in its cell
+	   */
+	  if (dict != NULL && dict_entries[j] < dict->num_loaded)
+	    {
+	      char *outline = dict_outline_name (dict, dict_entries[j]);
+	      fprintf (in, "reuse\t%03d\t%d\t%d\t%s\n", code_point, x, y,
+		       outline);
+	      free (outline);
+	      pixDestroy (&pix);
+	      stats_count (COUNTER_GLYPHS_REUSED, 1);
+	      continue;
+	    }
+
+	  /* New dictionary entries get their traced outline saved */
+	  char *outline = NULL;
+	  if (dict != NULL)
+	    {
+	      outline = dict_outline_name (dict, dict_entries[j]);
+	    }
+
+	  fprintf (in, "trace\t%03d\t%d\t%d\t%d\t%d\t%s\n", code_point, x, y,
+		   pixGetWidth (pix), pixGetHeight (pix),
+		   outline != NULL ? outline : "-");
+	  write_glyph_bitmap (in, pix);
+	  stats_count (COUNTER_GLYPHS_TRACED, 1);
+
+	  free (outline);
+
+	  if (fontdirname != NULL)
+	    {
+	      /* 1 for '/', 3 for %03d, 4 for '.png' */
+	      char *filename =
+		malloc_guarded (strlen (fontdirname) + 1 + 3 + 4 + 1);
+	      sprintf (filename, "%s/%03d.png", fontdirname, code_point);
+
+	      if (pixWrite (filename, pix, IFF_PNG) == 1)
+		{
+		  printf ("pixWrite failed to write %s.\n", filename);
+		  error_quit ("Could not write to file.");
+		}
+
+	      free (filename);
+	    }
+
+	  pixDestroy (&pix);
+	}
+
+      fclose (in);
+      finish_font_generator (pid, out_fd, &fonts[i]);
+
+      stats_stop (STAGE_FONT, &start, i);
+      stats_count (COUNTER_FONTS, 1);
+      stats_count (COUNTER_FONT_BYTES, fonts[i].size);
+
+      if (fonts[i].full_size > 0)
+	{
+	  long saved = (long) fonts[i].full_size - (long) fonts[i].size;
+
+	  printf ("Font %d: %lu bytes, %ld saved (%.1f%%)\n", i,
+		  (unsigned long) fonts[i].size, saved,
+		  100.0 * saved / fonts[i].full_size);
+	  stats_count (COUNTER_FONT_BYTES_SAVED, saved);
+
+	  total_size += fonts[i].size;
+	  total_full_size += fonts[i].full_size;
+	}
+
+      if (tmpdirname != NULL)
+	{
+	  /* 1 for '/', 8 for %08d, 1 for '.' */
+	  char *fontname =
+	    malloc_guarded (strlen (tmpdirname) + 1 + 8 + 1 +
+			    strlen (fonts[i].format) + 1);
+	  sprintf (fontname, "%s/%08d.%s", tmpdirname, i, fonts[i].format);
+
+	  if (l_binaryWrite (fontname, "w", fonts[i].data, fonts[i].size)
+	      == 1)
+	    {
+	      printf ("Failed to write %s.\n", fontname);
+	      error_quit ("Could not write to file.");
+	    }
+
+	  free (fontname);
+	  free (fontdirname);
+	}
+    }
+
+  if (total_full_size > 0)
+    {
+      long saved = (long) total_full_size - (long) total_size;
+
+      printf ("Outline optimization saved %ld of %lu font bytes (%.1f%%)\n",
+	      saved, total_full_size, 100.0 * saved / total_full_size);
+    }
+
+  return fonts;
+}
+
+const char *
+load_font_from_memory (HPDF_Doc pdf, const struct font_buffer *font)
+{
+  /*
+     libharu can only load TrueType fonts from a file, so this does
+     what HPDF_LoadTTFontFromFile does, but from a memory stream.
+   */
+  HPDF_Stream stream = HPDF_MemStream_New (pdf->mmgr, font->size);
+
+  if (!HPDF_Stream_Validate (stream)
+      || HPDF_Stream_Write (stream, font->data, font->size) != HPDF_OK)
+    {
+      error_quit ("Could not copy font into pdf.");
+    }
+
+  HPDF_FontDef def = HPDF_TTFontDef_Load (pdf->mmgr, stream, HPDF_TRUE);
+
+  if (def == NULL)
+    {
+      error_quit ("Could not load generated font.");
+    }
+
+  if (HPDF_List_Add (pdf->fontdef_list, def) != HPDF_OK)
+    {
+      HPDF_FontDef_Free (def);
+      error_quit ("Could not load generated font.");
+    }
+
+  /* Embedded subsets need a unique tag, same scheme libharu uses */
+  if (pdf->ttfont_tag[0] == 0)
+    {
+      memcpy (pdf->ttfont_tag, "HPDFAA", 6);
+    }
+  else
+    {
+      int i;
+      for (i = 5; i >= 0; i--)
+	{
+	  pdf->ttfont_tag[i] += 1;
+	  if (pdf->ttfont_tag[i] > 'Z')
+	    pdf->ttfont_tag[i] = 'A';
+	  else
+	    break;
+	}
+    }
+
+  HPDF_TTFontDef_SetTagName (def, (char *) pdf->ttfont_tag);
+
+  return def->base_font;
+}
+
+void
+generate_pdf (const char *outname, const struct font_buffer *font_data,
+	      int num_fonts, int first_page, int num_pages,
+	      const JBDATA * data, const struct mapping *maps,
+	      const struct ocr_result *ocr,
+	      const struct picture_list *pictures, int linearize,
+	      int debug_draw_borders)
+{
+  int i, j;
+  int start_comp = 0;
+  int next_picture = 0;
+  struct timespec start;
+  stats_start (&start);
+
+  /* Create the pdf document */
+  l_int32 ncomp = numaGetCount (data->naclass);
+  HPDF_Doc pdf = HPDF_New (pdf_error_handler, NULL);
+
+  HPDF_SetCompressionMode (pdf, HPDF_COMP_ALL);
+
+  /*
+     Fonts are loaded the first time a page uses them, so they are
+     stored in the order they are needed, and a volume only gets the
+     fonts its own pages use.
+   */
+  HPDF_Font *fonts = malloc_guarded (num_fonts * (sizeof (HPDF_Font)));
+
+  for (i = 0; i < num_fonts; i++)
+    {
+      fonts[i] = NULL;
+    }
+
+  /* Skip to the first page's components and pictures */
+  while (start_comp < ncomp)
+    {
+      l_int32 ipage;
+      numaGetIValue (data->napage, start_comp, &ipage);
+
+      if (ipage >= first_page)
+	break;
+
+      start_comp++;
+    }
+
+  while (pictures != NULL && next_picture < pictures->n
+	 && pictures->pictures[next_picture].page < first_page)
+    {
+      next_picture++;
+    }
+
+  for (j = first_page; j < first_page + num_pages; j++)
+    {
+      /* Add page to document */
+      HPDF_Page pg = HPDF_AddPage (pdf);
+
+      HPDF_Page_SetWidth (pg, data->w);
+      HPDF_Page_SetHeight (pg, data->h);
+
+      /* Pictures go under the text, they are stored in page order */
+      while (pictures != NULL && next_picture < pictures->n
+	     && pictures->pictures[next_picture].page == j)
+	{
+	  const struct picture *picture = &pictures->pictures[next_picture];
+	  HPDF_Image image;
+
+	  if (picture->format == IFF_PNG)
+	    image = HPDF_LoadPngImageFromMem (pdf, picture->data,
+					      picture->size);
+	  else
+	    image = HPDF_LoadJpegImageFromMem (pdf, picture->data,
+					       picture->size);
+
+	  HPDF_Page_DrawImage (pg, image, picture->x,
+			       data->h - picture->y - picture->h,
+			       picture->w, picture->h);
+	  next_picture++;
+	}
+
+      /*
+         Components are stored in page order, so each page starts
+         where the last one stopped, instead of rescanning the whole
+         book for every page.
+       */
+      for (i = start_comp; i < ncomp; i++)
+	{
+	  l_int32 ipage;
+	  l_int32 iclass;
+	  l_int32 x;
+	  l_int32 y;
+
+	  numaGetIValue (data->napage, i, &ipage);
+
+	  if (ipage > j)
+	    break;
+
+	  if (ipage != j)
+	    continue;
+
+	  numaGetIValue (data->naclass, i, &iclass);
+	  ptaGetIPt (data->ptaul, i, &x, &y);
+
+	  /*double left = x;
+	     double top = data->h - y;
+	     double right = x + data->latticew;
+	     double bottom = data->h - (y + data->latticeh); */
+
+	  char text[2];
+	  text[0] = maps[iclass].code_point;
+	  text[1] = '\0';
+
+	  int font_num = maps[iclass].font_num;
+
+	  if (fonts[font_num] == NULL)
+	    {
+	      const char *font_name =
+		load_font_from_memory (pdf, &font_data[font_num]);
+	      fonts[font_num] = HPDF_GetFont (pdf, font_name, "KOI8-R");
+
+	      if (ocr != NULL)
+		{
+		  add_to_unicode (pdf, fonts[font_num], font_num, data, maps,
+				  ocr);
+		}
+	    }
+
+	  HPDF_Font font = fonts[font_num];
+
+	  HPDF_Page_BeginText (pg);
+	  double fontsize = 100;
+
+	  if (fontsize > 300)
+	    {
+	      error_quit ("This is a known bug.\n"
+			  "libharu can't handle fontsizes bigger than 300, which is what is being requested here.\n"
+			  "Please report this bug, and the file that produced this error");
+	    }
+
+	  HPDF_Page_SetFontAndSize (pg, font, 100);
+
+	  HPDF_Page_MoveTextPos (pg, x, (data->h - y) - data->latticeh);
+	  HPDF_Page_ShowText (pg, text);
+
+	  HPDF_Page_EndText (pg);
+
+	  if (debug_draw_borders)
+	    {
+	      HPDF_Page_SetRGBStroke (pg, 1, 0, 0);
+	      /* In this, x, y is the LOWER LEFT, not UPPER LEFT */
+	      HPDF_Page_Rectangle (pg, x, (data->h - y) - data->latticeh,
+				   data->latticew, data->latticeh);
+	      HPDF_Page_Stroke (pg);
+	    }
+	}
+
+      start_comp = i;
+    }
+
+  stats_stop (STAGE_PDF_BUILD, &start, -1);
+  stats_start (&start);
+
+  /* Output */
+  if (linearize)
+    {
+      save_linearized (pdf, outname);
+    }
+  else
+    {
+      HPDF_SaveToFile (pdf, outname);
+    }
+
+  stats_stop (STAGE_PDF_SAVE, &start, -1);
+
+  struct stat st;
+  if (stat (outname, &st) == 0)
+    {
+      stats_count (COUNTER_OUTPUT_BYTES, st.st_size);
+    }
+
+  /* Cleanup */
+  HPDF_Free (pdf);
+  free (fonts);
+}
+
+void
+save_linearized (HPDF_Doc pdf, const char *outname)
+{
+#ifdef HAVE_QPDF
+  /* 4 for '.tmp' */
+  char *tmpname = malloc_guarded (strlen (outname) + 4 + 1);
+  sprintf (tmpname, "%s.tmp", outname);
+
+  HPDF_SaveToFile (pdf, tmpname);
+
+  qpdf_data qpdf = qpdf_init ();
+  qpdf_set_suppress_warnings (qpdf, QPDF_TRUE);
+
+  if ((qpdf_read (qpdf, tmpname, NULL) & QPDF_ERRORS) == 0)
+    {
+      qpdf_init_write (qpdf, outname);
+      qpdf_set_linearization (qpdf, QPDF_TRUE);
+      qpdf_write (qpdf);
+    }
+
+  if (qpdf_has_error (qpdf))
+    {
+      fprintf (stderr, "qpdf: %s\n",
+	       qpdf_get_error_full_text (qpdf, qpdf_get_error (qpdf)));
+      unlink (tmpname);
+      error_quit ("Could not linearize the pdf.");
+    }
+
+  qpdf_cleanup (&qpdf);
+
+  if (unlink (tmpname) == -1)
+    {
+      error_quit ("Could not remove temporary pdf.");
+    }
+
+  free (tmpname);
+#else
+  error_quit ("smoothscan was built without qpdf, so --linearize is not "
+	      "available.");
+#endif
+}
+
+char *
+volume_name (const char *outname, int volume, int num_volumes)
+{
+  int digits = num_digits (num_volumes);
+  size_t len = strlen (outname);
+
+  if (digits < 2)
+    digits = 2;
+
+  /* Keep the extension at the end */
+  if (len > 4 && strcasecmp (outname + len - 4, ".pdf") == 0)
+    len -= 4;
+
+  /* 1 for '-' */
+  char *name = malloc_guarded (strlen (outname) + 1 + digits + 1);
+  sprintf (name, "%.*s-%0*d%s", (int) len, outname, digits, volume + 1,
+	   outname + len);
+
+  return name;
+}
+
+/* Read the object at offset, up to its endobj. The caller must free it. */
+static char *
+read_pdf_object (FILE * f, long offset)
+{
+  size_t size = 0;
+  size_t capacity = 4096;
+  char *text = malloc_guarded (capacity + 1);
+
+  if (fseek (f, offset, SEEK_SET) != 0)
+    {
+      error_quit ("Could not read pdf object.");
+    }
+
+  while (1)
+    {
+      size_t n = fread (text + size, 1, capacity - size, f);
+
+      size += n;
+      text[size] = '\0';
+
+      if (strstr (text, "endobj") != NULL)
+	break;
+
+      if (n == 0)
+	{
+	  error_quit ("Unterminated pdf object.");
+	}
+
+      if (size == capacity)
+	{
+	  capacity *= 2;
+	  text = realloc_guarded (text, capacity + 1);
+	}
+    }
+
+  return text;
+}
+
+/* The number of the object a key like "/Root" refers to, or 0 */
+static long
+pdf_ref (const char *dict, const char *key)
+{
+  long num = 0;
+  const char *p = strstr (dict, key);
+
+  if (p == NULL || sscanf (p + strlen (key), " %ld %*d R", &num) != 1)
+    return 0;
+
+  return num;
+}
+
+/*
+  Read the xref section at offset, looking for object num. Returns
+  its offset, or -1 if it's not in this section, and puts the
+  section's trailer dictionary in trailer.
+*/
+static long
+read_xref_section (FILE * f, long offset, long num, char *trailer,
+		   size_t trailer_size)
+{
+  char word[16];
+  long found = -1;
+  long start, count;
+
+  if (fseek (f, offset, SEEK_SET) != 0 || fscanf (f, " %15s", word) != 1
+      || strcmp (word, "xref") != 0)
+    {
+      error_quit ("Only pdfs with xref tables can be updated.");
+    }
+
+  while (fscanf (f, " %ld %ld", &start, &count) == 2)
+    {
+      /* Every entry is exactly 20 bytes, so skip to the one we want */
+      fscanf (f, " ");
+      long entries = ftell (f);
+
+      if (num >= start && num < start + count)
+	{
+	  long entry_offset;
+	  char type;
+
+	  fseek (f, entries + (num - start) * 20, SEEK_SET);
+	  if (fscanf (f, "%ld %*d %c", &entry_offset, &type) == 2
+	      && type == 'n')
+	    found = entry_offset;
+	}
+
+      fseek (f, entries + count * 20, SEEK_SET);
+    }
+
+  if (fscanf (f, " %15s", word) != 1 || strcmp (word, "trailer") != 0)
+    {
+      error_quit ("Broken pdf trailer.");
+    }
+
+  size_t n = fread (trailer, 1, trailer_size - 1, f);
+  trailer[n] = '\0';
+
+  char *end = strstr (trailer, "startxref");
+  if (end != NULL)
+    *end = '\0';
+
+  return found;
+}
+
+/* Find object num, through the /Prev chain of xref sections */
+static long
+find_pdf_object (FILE * f, long xref, long num)
+{
+  char trailer[4096];
+
+  while (xref > 0)
+    {
+      long offset = read_xref_section (f, xref, num, trailer,
+				       sizeof (trailer));
+      const char *prev;
+
+      if (offset >= 0)
+	return offset;
+
+      prev = strstr (trailer, "/Prev");
+      if (prev == NULL || sscanf (prev + 5, " %ld", &xref) != 1)
+	break;
+    }
+
+  error_quit ("Object missing from pdf.");
+  return -1;
+}
+
+struct pdf_info *
+read_pdf_info (const char *filename)
+{
+  char tail[1024];
+  char trailer[4096];
+  FILE *f = fopen (filename, "rb");
+
+  if (f == NULL)
+    {
+      printf ("Failed to open %s.\n", filename);
+      error_quit ("Could not read pdf.");
+    }
+
+  struct pdf_info *info = malloc_guarded (sizeof (struct pdf_info));
+
+  /* startxref is at the very end */
+  fseek (f, 0, SEEK_END);
+  long file_size = ftell (f);
+  long tail_start = file_size > 1023 ? file_size - 1023 : 0;
+
+  fseek (f, tail_start, SEEK_SET);
+  size_t n = fread (tail, 1, file_size - tail_start, f);
+  tail[n] = '\0';
+
+  /* The tail may be binary, so find the last startxref by hand */
+  char *p = NULL;
+  size_t i;
+
+  for (i = 0; i + 9 <= n; i++)
+    {
+      if (memcmp (tail + i, "startxref", 9) == 0)
+	p = tail + i;
+    }
+
+  if (p == NULL || sscanf (p + 9, " %ld", &info->startxref) != 1)
+    {
+      error_quit ("No startxref in pdf.");
+    }
+
+  read_xref_section (f, info->startxref, -1, trailer, sizeof (trailer));
+
+  const char *size = strstr (trailer, "/Size");
+  if (size == NULL || sscanf (size + 5, " %ld", &info->size) != 1)
+    {
+      error_quit ("No /Size in pdf trailer.");
+    }
+
+  info->root = pdf_ref (trailer, "/Root");
+  info->info = pdf_ref (trailer, "/Info");
+
+  /* Keep the document's /ID, which updates must repeat */
+  info->id[0] = '\0';
+  const char *id = strstr (trailer, "/ID");
+  if (id != NULL)
+    {
+      const char *end = strchr (id, ']');
+
+      if (end != NULL && (size_t) (end - id + 1) < sizeof (info->id))
+	{
+	  memcpy (info->id, id, end - id + 1);
+	  info->id[end - id + 1] = '\0';
+	}
+    }
+
+  if (info->root == 0)
+    {
+      error_quit ("No /Root in pdf trailer.");
+    }
+
+  char *catalog =
+    read_pdf_object (f, find_pdf_object (f, info->startxref, info->root));
+  info->pages = pdf_ref (catalog, "/Pages");
+  free (catalog);
+
+  if (info->pages == 0)
+    {
+      error_quit ("No /Pages in pdf catalog.");
+    }
+
+  char *pages =
+    read_pdf_object (f, find_pdf_object (f, info->startxref, info->pages));
+  const char *kids = strstr (pages, "/Kids");
+  const char *count = strstr (pages, "/Count");
+  long num_pages = -1;
+
+  if (kids == NULL || count == NULL
+      || sscanf (count + 6, " %ld", &num_pages) != 1)
+    {
+      error_quit ("Broken pdf page tree.");
+    }
+
+  kids = strchr (kids, '[');
+  info->num_kids = 0;
+  info->kids = malloc_guarded ((num_pages > 0 ? num_pages : 1) *
+			       sizeof (long));
+
+  if (kids != NULL)
+    {
+      long kid;
+      int used;
+
+      kids++;
+      while (sscanf (kids, " %ld %*d R%n", &kid, &used) == 1)
+	{
+	  if (info->num_kids == num_pages)
+	    break;
+	  info->kids[info->num_kids++] = kid;
+	  kids += used;
+	}
+    }
+
+  /* smoothscan (libharu) keeps all the pages in the root */
+  if (info->num_kids != num_pages)
+    {
+      error_quit ("Only pdfs with a flat page tree can be updated.");
+    }
+
+  free (pages);
+  fclose (f);
+
+  return info;
+}
+
+void
+destroy_pdf_info (struct pdf_info *info)
+{
+  free (info->kids);
+  free (info);
+}
+
+/*
+  Write text with every "n g R" reference renumbered by map (of
+  map_size entries).
+*/
+static void
+write_renumbered (FILE * out, const char *text, size_t len,
+		  const long *map, long map_size)
+{
+  size_t i = 0;
+
+  while (i < len)
+    {
+      long num, gen;
+      int used = 0;
+
+      if (isdigit ((unsigned char) text[i])
+	  && (i == 0 || (!isalnum ((unsigned char) text[i - 1])
+			 && text[i - 1] != '.' && text[i - 1] != '-'))
+	  && sscanf (text + i, "%ld %ld R%n", &num, &gen, &used) == 2
+	  && used > 0 && i + used <= len
+	  && (i + used == len || !isalnum ((unsigned char) text[i + used]))
+	  && num >= 0 && num < map_size && map[num] > 0)
+	{
+	  fprintf (out, "%ld %ld R", map[num], gen);
+	  i += used;
+	  continue;
+	}
+
+      fputc (text[i], out);
+      i++;
+    }
+}
+
+/*
+  Append the pages of the pdf made for them, newname, to book as an
+  incremental update. The objects are renumbered after the book's, the
+  pages join the book's page tree, and a new xref section points back
+  to the old one with /Prev.
+*/
+static void
+append_pdf_update (const char *bookname, const struct pdf_info *book,
+		   const char *newname, int first_page)
+{
+  long i;
+  size_t new_size;
+  char *new_data = (char *) l_binaryRead (newname, &new_size);
+
+  if (new_data == NULL)
+    {
+      error_quit ("Could not read the new pages back.");
+    }
+
+  struct pdf_info *pages = read_pdf_info (newname);
+
+  /* Where every object of the new pdf is */
+  long *offsets = malloc_guarded (pages->size * sizeof (long));
+  FILE *f = fopen (newname, "rb");
+  char trailer[4096];
+
+  for (i = 0; i < pages->size; i++)
+    {
+      offsets[i] = read_xref_section (f, pages->startxref, i, trailer,
+				      sizeof (trailer));
+    }
+  fclose (f);
+
+  /* The catalog, page tree root and Info of the new pdf aren't needed */
+  long *map = malloc_guarded (pages->size * sizeof (long));
+  long next = book->size;
+
+  for (i = 0; i < pages->size; i++)
+    {
+      if (offsets[i] < 0 || i == pages->root || i == pages->info)
+	map[i] = 0;
+      else if (i == pages->pages)
+	map[i] = book->pages;
+      else
+	map[i] = next++;
+    }
+
+  FILE *book_file = fopen (bookname, "r+b");
+
+  if (book_file == NULL || fseek (book_file, 0, SEEK_END) != 0)
+    {
+      printf ("Failed to open %s.\n", bookname);
+      error_quit ("Could not update pdf.");
+    }
+
+  long book_end = ftell (book_file);
+
+  /*
+     The whole update is built in memory first, and only appended to
+     the book once it is complete, so nothing that goes wrong here can
+     leave the book with a half written tail.
+   */
+  char *update;
+  size_t update_size;
+  FILE *out = open_memstream (&update, &update_size);
+
+  if (out == NULL)
+    {
+      error_quit ("Could not build the pdf update.");
+    }
+
+  fputc ('\n', out);
+
+  long *new_offsets = malloc_guarded ((next - book->size + 1) * sizeof (long));
+
+  for (i = 0; i < pages->size; i++)
+    {
+      if (map[i] < book->size)
+	continue;
+
+      /* An object ends where the next one starts, or at the xref */
+      long start = offsets[i];
+      long end = pages->startxref;
+      long j;
+
+      for (j = 0; j < pages->size; j++)
+	{
+	  if (offsets[j] > start && offsets[j] < end)
+	    end = offsets[j];
+	}
+
+      const char *text = new_data + start;
+      const char *obj = memmem (text, end - start, "obj", 3);
+
+      if (obj == NULL)
+	{
+	  error_quit ("Broken object in new pages.");
+	}
+
+      obj += 3;
+
+      /* Only the dictionary is renumbered, stream data is copied */
+      const char *stream = NULL;
+      const char *search = obj;
+
+      while ((search = memmem (search, new_data + end - search, "stream",
+			       6)) != NULL)
+	{
+	  const char *before = search;
+
+	  while (before > obj && isspace ((unsigned char) before[-1]))
+	    before--;
+
+	  if (before - obj >= 2 && before[-1] == '>' && before[-2] == '>'
+	      && (search[6] == '\r' || search[6] == '\n'))
+	    {
+	      stream = search;
+	      break;
+	    }
+	  search += 6;
+	}
+
+      const char *dict_end = stream != NULL ? stream : new_data + end;
+
+      new_offsets[map[i] - book->size] = book_end + ftell (out);
+      fprintf (out, "%ld 0 obj", map[i]);
+      write_renumbered (out, obj, dict_end - obj, map, pages->size);
+
+      if (stream != NULL)
+	fwrite (stream, 1, new_data + end - stream, out);
+    }
+
+  /* The book's page tree, with the new pages in it */
+  long pages_offset = book_end + ftell (out);
+  int num_kids = book->num_kids;
+
+  if (first_page + pages->num_kids > num_kids)
+    num_kids = first_page + pages->num_kids;
+
+  fprintf (out, "%ld 0 obj\n<<\n/Type /Pages\n/Kids [", book->pages);
+  for (i = 0; i < num_kids; i++)
+    {
+      long kid;
+
+      if (i >= first_page && i < first_page + pages->num_kids)
+	kid = map[pages->kids[i - first_page]];
+      else
+	kid = book->kids[i];
+
+      fprintf (out, "%s%ld 0 R", i > 0 ? " " : "", kid);
+    }
+  fprintf (out, "]\n/Count %d\n>>\nendobj\n", num_kids);
+
+  /* The update's xref, and a trailer linking back to the last one */
+  long xref = book_end + ftell (out);
+
+  fprintf (out, "xref\n%ld 1\n%010ld 00000 n \n", book->pages,
+	   pages_offset);
+  if (next > book->size)
+    {
+      fprintf (out, "%ld %ld\n", book->size, next - book->size);
+      for (i = 0; i < next - book->size; i++)
+	fprintf (out, "%010ld 00000 n \n", new_offsets[i]);
+    }
+
+  fprintf (out, "trailer\n<<\n/Size %ld\n/Root %ld 0 R\n", next, book->root);
+  if (book->info > 0)
+    fprintf (out, "/Info %ld 0 R\n", book->info);
+  if (book->id[0] != '\0')
+    fprintf (out, "%s\n", book->id);
+  fprintf (out, "/Prev %ld\n>>\nstartxref\n%ld\n%%%%EOF\n", book->startxref,
+	   xref);
+
+  if (fclose (out) != 0)
+    {
+      error_quit ("Could not build the pdf update.");
+    }
+
+  /* Append it in one go, and cut the book back if that fails */
+  if (fwrite (update, 1, update_size, book_file) != update_size
+      || fflush (book_file) != 0 || fsync (fileno (book_file)) != 0)
+    {
+      if (ftruncate (fileno (book_file), book_end) != 0)
+	printf ("Could not restore %s, cut it back to %ld bytes.\n",
+		bookname, book_end);
+      error_quit ("Could not update pdf.");
+    }
+
+  if (fclose (book_file) != 0)
+    {
+      if (truncate (bookname, book_end) != 0)
+	printf ("Could not restore %s, cut it back to %ld bytes.\n",
+		bookname, book_end);
+      error_quit ("Could not update pdf.");
+    }
+
+  printf ("%s now has %d pages, %ld objects added\n", bookname, num_kids,
+	  next - book->size);
+
+  free (update);
+  free (new_offsets);
+  free (map);
+  free (offsets);
+  destroy_pdf_info (pages);
+  free (new_data);
+}
+
+void
+update_pdf (const char *bookname, const struct pdf_info *book,
+	    int first_page, const struct font_buffer *font_data,
+	    int num_fonts, int num_pages, const JBDATA * data,
+	    const struct mapping *maps, const struct ocr_result *ocr,
+	    const struct picture_list *pictures, int debug_draw_borders)
+{
+  char suffix[] = "smoothscan_update_XXXXXX";
+  char *tmpdir = getenv ("TMPDIR");
+
+  if (tmpdir == NULL)
+    tmpdir = P_tmpdir;
+
+  char *tmpname = malloc_guarded (strlen (tmpdir) + 1 + strlen (suffix) + 1);
+  sprintf (tmpname, "%s/%s", tmpdir, suffix);
+
+  int fd = mkstemp (tmpname);
+
+  if (fd == -1)
+    {
+      error_quit ("Failed to create temp file for the new pages.");
+    }
+  close (fd);
+
+  /* libharu makes the new pages, fonts and all, on their own */
+  generate_pdf (tmpname, font_data, num_fonts, 0, num_pages, data, maps,
+		ocr, pictures, 0, debug_draw_borders);
+
+  append_pdf_update (bookname, book, tmpname, first_page);
+
+  unlink (tmpname);
+  free (tmpname);
+}
+
+l_uint32
+koi8r_to_unicode (unsigned char c)
+{
+  static const l_uint32 upper[128] = {
+    0x2500, 0x2502, 0x250c, 0x2510, 0x2514, 0x2518, 0x251c, 0x2524,
+    0x252c, 0x2534, 0x253c, 0x2580, 0x2584, 0x2588, 0x258c, 0x2590,
+    0x2591, 0x2592, 0x2593, 0x2320, 0x25a0, 0x2219, 0x221a, 0x2248,
+    0x2264, 0x2265, 0x00a0, 0x2321, 0x00b0, 0x00b2, 0x00b7, 0x00f7,
+    0x2550, 0x2551, 0x2552, 0x0451, 0x2553, 0x2554, 0x2555, 0x2556,
+    0x2557, 0x2558, 0x2559, 0x255a, 0x255b, 0x255c, 0x255d, 0x255e,
+    0x255f, 0x2560, 0x2561, 0x0401, 0x2562, 0x2563, 0x2564, 0x2565,
+    0x2566, 0x2567, 0x2568, 0x2569, 0x256a, 0x256b, 0x256c, 0x00a9,
+    0x044e, 0x0430, 0x0431, 0x0446, 0x0434, 0x0435, 0x0444, 0x0433,
+    0x0445, 0x0438, 0x0439, 0x043a, 0x043b, 0x043c, 0x043d, 0x043e,
+    0x043f, 0x044f, 0x0440, 0x0441, 0x0442, 0x0443, 0x0436, 0x0432,
+    0x044c, 0x044b, 0x0437, 0x0448, 0x044d, 0x0449, 0x0447, 0x044a,
+    0x042e, 0x0410, 0x0411, 0x0426, 0x0414, 0x0415, 0x0424, 0x0413,
+    0x0425, 0x0418, 0x0419, 0x041a, 0x041b, 0x041c, 0x041d, 0x041e,
+    0x041f, 0x042f, 0x0420, 0x0421, 0x0422, 0x0423, 0x0416, 0x0412,
+    0x042c, 0x042b, 0x0417, 0x0428, 0x042d, 0x0429, 0x0427, 0x042a
+  };
+
+  if (c < 128)
+    return c;
+
+  return upper[c - 128];
+}
+
+/*
+  Write c to out as UTF-8, escaping the characters that are special in
+  XML.
+*/
+static void
+write_xml_char (FILE * out, l_uint32 c)
+{
+  if (c == '<')
+    fputs ("&lt;", out);
+  else if (c == '>')
+    fputs ("&gt;", out);
+  else if (c == '&')
+    fputs ("&amp;", out);
+  else if (c < 0x80)
+    fputc (c, out);
+  else if (c < 0x800)
+    {
+      fputc (0xc0 | (c >> 6), out);
+      fputc (0x80 | (c & 0x3f), out);
+    }
+  else
+    {
+      fputc (0xe0 | (c >> 12), out);
+      fputc (0x80 | ((c >> 6) & 0x3f), out);
+      fputc (0x80 | (c & 0x3f), out);
+    }
+}
+
+static void
+make_html_dir (const char *outdir, const char *name)
+{
+  char *path = malloc_guarded (strlen (outdir) + 1 + strlen (name) + 1);
+  sprintf (path, "%s/%s", outdir, name);
+
+  if (mkdir (path, 0755) == -1 && errno != EEXIST)
+    {
+      printf ("Failed to create %s.\n", path);
+      error_quit ("Could not create output directory.");
+    }
+
+  free (path);
+}
+
+static FILE *
+open_html_file (const char *outdir, const char *name)
+{
+  char *path = malloc_guarded (strlen (outdir) + 1 + strlen (name) + 1);
+  sprintf (path, "%s/%s", outdir, name);
+
+  FILE *out = fopen (path, "wb");
+
+  if (out == NULL)
+    {
+      printf ("Failed to open %s.\n", path);
+      error_quit ("Could not write to file.");
+    }
+
+  free (path);
+
+  return out;
+}
+
+/*
+  Close a file opened by open_html_file, returning how many bytes were
+  written to it.
+*/
+static long
+close_html_file (FILE * out)
+{
+  long size = ftell (out);
+
+  if (fclose (out) != 0)
+    {
+      error_quit ("Could not write to file.");
+    }
+
+  return size;
+}
+
+/* The viewer, it only needs pages.json and fonts.css next to it */
+static const char *html_viewer =
+  "<!DOCTYPE html>\n"
+  "<html>\n"
+  "<head>\n"
+  "<meta charset=\"utf-8\">\n"
+  "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n"
+  "<title>Smoothscan</title>\n"
+  "<link rel=\"stylesheet\" href=\"fonts.css\">\n"
+  "<style>\n"
+  "body { margin: 0; background: #777; }\n"
+  ".page { background: #fff; width: 100%; max-width: 60em;"
+  " margin: 0.5em auto; }\n"
+  ".page svg { display: block; width: 100%; height: 100%; }\n"
+  "text { font-kerning: none; font-variant-ligatures: none; }\n"
+  "</style>\n"
+  "</head>\n"
+  "<body>\n"
+  "<div id=\"pages\"></div>\n"
+  "<script>\n"
+  "/* Lay out empty pages, and fetch each one as it nears the screen */\n"
+  "fetch(\"pages.json\").then(function (response) {\n"
+  "  return response.json();\n"
+  "}).then(function (index) {\n"
+  "  var container = document.getElementById(\"pages\");\n"
+  "  var observer = new IntersectionObserver(function (entries) {\n"
+  "    entries.forEach(function (entry) {\n"
+  "      if (!entry.isIntersecting)\n"
+  "        return;\n"
+  "      var div = entry.target;\n"
+  "      observer.unobserve(div);\n"
+  "      fetch(div.dataset.file).then(function (response) {\n"
+  "        return response.text();\n"
+  "      }).then(function (svg) {\n"
+  "        div.innerHTML = svg;\n"
+  "      });\n"
+  "    });\n"
+  "  }, { rootMargin: \"100% 0px\" });\n"
+  "  index.pages.forEach(function (page) {\n"
+  "    var div = document.createElement(\"div\");\n"
+  "    div.className = \"page\";\n"
+  "    div.style.aspectRatio = page.width + \" / \" + page.height;\n"
+  "    div.dataset.file = page.file;\n"
+  "    container.appendChild(div);\n"
+  "    observer.observe(div);\n"
+  "  });\n"
+  "});\n"
+  "</script>\n"
+  "</body>\n"
+  "</html>\n";
+
+void
+generate_html (const char *outdir, const struct font_buffer *font_data,
+	       int num_fonts, int num_pages, const JBDATA * data,
+	       const struct mapping *maps,
+	       const struct picture_list *pictures)
+{
+  int i, j, k;
+  int start_comp = 0;
+  int next_picture = 0;
+  long bytes = 0;
+  char name[64];
+  l_int32 ncomp = numaGetCount (data->naclass);
+  struct timespec start;
+  stats_start (&start);
+
+  if (mkdir (outdir, 0755) == -1 && errno != EEXIST)
+    {
+      error_quit ("Could not create output directory.");
+    }
+
+  make_html_dir (outdir, "fonts");
+  make_html_dir (outdir, "pages");
+  make_html_dir (outdir, "images");
+
+  /* The fonts, and the rules that name them */
+  FILE *css = open_html_file (outdir, "fonts.css");
+
+  for (i = 0; i < num_fonts; i++)
+    {
+      const char *css_format = font_data[i].format;
+
+      if (strcmp (css_format, "ttf") == 0)
+	css_format = "truetype";
+
+      sprintf (name, "fonts/ss%d.%s", i, font_data[i].format);
+
+      FILE *font = open_html_file (outdir, name);
+      fwrite (font_data[i].data, 1, font_data[i].size, font);
+      bytes += close_html_file (font);
+
+      fprintf (css, "@font-face { font-family: ss%d; src: url(\"%s\") "
+	       "format(\"%s\"); font-display: block; }\n", i, name,
+	       css_format);
+      fprintf (css, ".f%d { font-family: ss%d; }\n", i, i);
+    }
+
+  bytes += close_html_file (css);
+
+  FILE *index = open_html_file (outdir, "pages.json");
+  fprintf (index, "{\n\"pages\": [\n");
+
+  /* How many glyphs of each font are on the current page */
+  int *page_glyphs = malloc_guarded ((num_fonts + 1) * sizeof (int));
+
+  for (j = 0; j < num_pages; j++)
+    {
+      sprintf (name, "pages/%05d.svg", j + 1);
+
+      FILE *svg = open_html_file (outdir, name);
+
+      /*
+         Same coordinates as the pdf: one unit per input pixel, and a
+         font size of 100.
+       */
+      fprintf (svg, "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+	       "viewBox=\"0 0 %d %d\" font-size=\"100\">\n", data->w,
+	       data->h);
+
+      /* Pictures go under the text, they are stored in page order */
+      for (k = 0; pictures != NULL && next_picture < pictures->n
+	   && pictures->pictures[next_picture].page == j; k++)
+	{
+	  const struct picture *picture = &pictures->pictures[next_picture];
+	  char image_name[64];
+
+	  sprintf (image_name, "images/%05d-%d.%s", j + 1, k,
+		   picture->format == IFF_PNG ? "png" : "jpg");
+
+	  FILE *image = open_html_file (outdir, image_name);
+	  fwrite (picture->data, 1, picture->size, image);
+	  bytes += close_html_file (image);
+
+	  fprintf (svg, "<image x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" "
+		   "href=\"%s\"/>\n", picture->x, picture->y, picture->w,
+		   picture->h, image_name);
+	  next_picture++;
+	}
+
+      /* Components are stored in page order, find where this page ends */
+      int page_start = start_comp;
+
+      for (i = start_comp; i < ncomp; i++)
+	{
+	  l_int32 ipage;
+	  numaGetIValue (data->napage, i, &ipage);
+
+	  if (ipage > j)
+	    break;
+	}
+
+      int page_end = i;
+      start_comp = i;
+
+      memset (page_glyphs, 0, num_fonts * sizeof (int));
+
+      for (i = page_start; i < page_end; i++)
+	{
+	  l_int32 iclass;
+	  numaGetIValue (data->naclass, i, &iclass);
+	  page_glyphs[maps[iclass].font_num]++;
+	}
+
+      /*
+         One text element per font, with a position for every glyph,
+         so a page is a handful of elements however many glyphs it has.
+       */
+      for (k = 0; k < num_fonts; k++)
+	{
+	  if (page_glyphs[k] == 0)
+	    continue;
+
+	  int pass;
+
+	  fprintf (svg, "<text class=\"f%d\"", k);
+
+	  for (pass = 0; pass < 3; pass++)
+	    {
+	      int first = 1;
+
+	      if (pass == 0)
+		fprintf (svg, " x=\"");
+	      else if (pass == 1)
+		fprintf (svg, "\" y=\"");
+	      else
+		fprintf (svg, "\">");
+
+	      for (i = page_start; i < page_end; i++)
+		{
+		  l_int32 iclass;
+		  l_int32 x;
+		  l_int32 y;
+
+		  numaGetIValue (data->naclass, i, &iclass);
+
+		  if (maps[iclass].font_num != k)
+		    continue;
+
+		  ptaGetIPt (data->ptaul, i, &x, &y);
+
+		  if (pass == 0)
+		    fprintf (svg, first ? "%d" : " %d", x);
+		  else if (pass == 1)
+		    fprintf (svg, first ? "%d" : " %d", y + data->latticeh);
+		  else
+		    write_xml_char (svg,
+				    koi8r_to_unicode (maps[iclass].code_point));
+
+		  first = 0;
+		}
+	    }
+
+	  fprintf (svg, "</text>\n");
+	}
+
+      fprintf (svg, "</svg>\n");
+      bytes += close_html_file (svg);
+
+      /* The page's fonts let a viewer start loading them early */
+      fprintf (index, "{\"file\": \"%s\", \"width\": %d, \"height\": %d, "
+	       "\"fonts\": [", name, data->w, data->h);
+
+      int first = 1;
+      for (k = 0; k < num_fonts; k++)
+	{
+	  if (page_glyphs[k] == 0)
+	    continue;
+	  fprintf (index, first ? "%d" : ", %d", k);
+	  first = 0;
+	}
+
+      fprintf (index, "]}%s\n", j + 1 < num_pages ? "," : "");
+    }
+
+  free (page_glyphs);
+
+  fprintf (index, "]\n}\n");
+  bytes += close_html_file (index);
+
+  FILE *viewer = open_html_file (outdir, "index.html");
+  fputs (html_viewer, viewer);
+  bytes += close_html_file (viewer);
+
+  stats_stop (STAGE_HTML, &start, -1);
+  stats_count (COUNTER_OUTPUT_BYTES, bytes);
+}
+
+/*
+  Return 1 if format is one of leptonica's TIFF formats, 0 if not.
+*/
+static int
+is_tiff_format (l_int32 format)
+{
+  return (format == IFF_TIFF || format == IFF_TIFF_PACKBITS
+	  || format == IFF_TIFF_RLE || format == IFF_TIFF_G3
+	  || format == IFF_TIFF_G4 || format == IFF_TIFF_LZW
+	  || format == IFF_TIFF_ZIP);
+}
+
+struct page_source *
+open_page_source (int num_input_files, char **input_files, int binarize,
+		  int num_threads, int mixed)
+{
+  int i, j;
+  struct page_source *src = malloc_guarded (sizeof (struct page_source));
+
+  src->binarize = binarize;
+  src->num_threads = num_threads;
+  src->mixed = mixed;
+  src->num_files = num_input_files;
+  src->input_files = input_files;
+  src->file_pages = malloc_guarded (num_input_files * sizeof (int));
+  src->file_is_tiff = malloc_guarded (num_input_files * sizeof (int));
+  src->stdin_data = NULL;
+  src->stdin_size = 0;
+  src->num_pages = 0;
+
+  /* Only count the pages here, nothing is decoded until it's needed */
+  for (i = 0; i < num_input_files; i++)
+    {
+      l_int32 format = IFF_UNKNOWN;
+      FILE *fp = NULL;
+
+      if (strcmp (input_files[i], "-") == 0)
+	{
+	  /*
+	     stdin can't be read twice, so keep its (still compressed)
+	     contents in memory and decode pages from there.
+	   */
+	  src->stdin_data = l_binaryReadStream (stdin, &src->stdin_size);
+
+	  if (src->stdin_data == NULL || src->stdin_size == 0)
+	    {
+	      error_quit ("Unable to read input from stdin.");
+	    }
+
+	  findFileFormatBuffer (src->stdin_data, &format);
+
+	  if (is_tiff_format (format))
+	    {
+	      fp = fmemopen (src->stdin_data, src->stdin_size, "r");
+	    }
+	}
+      else
+	{
+	  findFileFormat (input_files[i], &format);
+
+	  if (is_tiff_format (format))
+	    {
+	      fp = fopenReadStream (input_files[i]);
+	    }
+	}
+
+      src->file_is_tiff[i] = is_tiff_format (format);
+      src->file_pages[i] = 1;
+
+      if (src->file_is_tiff[i])
+	{
+	  l_int32 n = 0;
+
+	  if (fp == NULL || tiffGetCount (fp, &n) == 1 || n < 1)
+	    {
+	      printf ("Problem with input file %s\n", input_files[i]);
+	      error_quit ("Unable to count pages in TIFF.");
+	    }
+
+	  fclose (fp);
+	  src->file_pages[i] = n;
+	}
+
+      src->num_pages += src->file_pages[i];
+    }
+
+  src->page_file = malloc_guarded (src->num_pages * sizeof (int));
+  src->page_subpage = malloc_guarded (src->num_pages * sizeof (int));
+  src->page_offset = malloc_guarded (src->num_pages * sizeof (size_t));
+  memset (src->page_offset, 0, src->num_pages * sizeof (size_t));
+  src->offset_lock = malloc_guarded (sizeof (pthread_mutex_t));
+  pthread_mutex_init (src->offset_lock, NULL);
+
+  int page = 0;
+  for (i = 0; i < num_input_files; i++)
+    {
+      for (j = 0; j < src->file_pages[i]; j++)
+	{
+	  src->page_file[page] = i;
+	  src->page_subpage[page] = j;
+	  page++;
+	}
+    }
+
+  printf ("%d Input Pages\n", src->num_pages);
+
+  return src;
+}
+
+PIX *
+read_page (const struct page_source *src, int page)
+{
+  int file = src->page_file[page];
+  int subpage = src->page_subpage[page];
+  const char *filename = src->input_files[file];
+
+  int from_stdin = strcmp (filename, "-") == 0;
+
+  if (!src->file_is_tiff[file])
+    {
+      if (from_stdin)
+	return pixReadMem (src->stdin_data, src->stdin_size);
+      else
+	return pixRead (filename);
+    }
+
+  pthread_mutex_lock (src->offset_lock);
+  size_t offset = src->page_offset[page];
+  pthread_mutex_unlock (src->offset_lock);
+
+  /*
+     Without the offset, leptonica has to walk the directories from the
+     start of the file. That only happens when pages are read out of
+     order, the classifier reads them in order.
+   */
+  if (subpage > 0 && offset == 0)
+    {
+      if (from_stdin)
+	return pixReadMemTiff (src->stdin_data, src->stdin_size, subpage);
+      else
+	return pixReadTiff (filename, subpage);
+    }
+
+  PIX *pix;
+
+  if (from_stdin)
+    pix = pixReadMemFromMultipageTiff (src->stdin_data, src->stdin_size,
+				       &offset);
+  else
+    pix = pixReadFromMultipageTiff (filename, &offset);
+
+  /* offset is now where the next page starts */
+  if (pix != NULL && subpage + 1 < src->file_pages[file] && offset != 0)
+    {
+      pthread_mutex_lock (src->offset_lock);
+      src->page_offset[page + 1] = offset;
+      pthread_mutex_unlock (src->offset_lock);
+    }
+
+  return pix;
+}
+
+struct picture_list *
+create_picture_list (int jpeg_quality)
+{
+  struct picture_list *list = malloc_guarded (sizeof (struct picture_list));
+
+  list->jpeg_quality = jpeg_quality;
+  list->n = 0;
+  list->capacity = 16;
+  list->pictures = malloc_guarded (list->capacity * sizeof (struct picture));
+
+  return list;
+}
+
+void
+destroy_picture_list (struct picture_list *list)
+{
+  int i;
+
+  for (i = 0; i < list->n; i++)
+    {
+      free (list->pictures[i].data);
+    }
+
+  free (list->pictures);
+  free (list);
+}
+
+/*
+  Cut the region box out of the original page, and add it to list
+  compressed. Gray and color regions become JPEG, black and white
+  ones (like halftones in a 1bpp scan) become PNG.
+*/
+static void
+add_picture (struct picture_list *list, PIX * orig, int page, BOX * box)
+{
+  PIX *clip = pixClipRectangle (orig, box, NULL);
+  PIX *pix = NULL;
+  int format;
+
+  if (clip == NULL)
+    {
+      error_quit ("Unable to cut picture out of page.");
+    }
+
+  if (pixGetDepth (clip) == 1)
+    {
+      pix = pixClone (clip);
+      format = IFF_PNG;
+    }
+  else
+    {
+      PIX *pixc = pixRemoveColormap (clip, REMOVE_CMAP_BASED_ON_SRC);
+
+      if (pixGetDepth (pixc) == 8 || pixGetDepth (pixc) == 32)
+	pix = pixClone (pixc);
+      else
+	pix = pixConvertTo8 (pixc, 0);
+
+      pixDestroy (&pixc);
+      format = IFF_JFIF_JPEG;
+    }
+
+  if (list->n == list->capacity)
+    {
+      list->capacity *= 2;
+      list->pictures = realloc_guarded (list->pictures,
+					list->capacity *
+					sizeof (struct picture));
+    }
+
+  struct picture *picture = &list->pictures[list->n];
+
+  picture->page = page;
+  boxGetGeometry (box, &picture->x, &picture->y, &picture->w, &picture->h);
+  picture->format = format;
+
+  int ret;
+  if (format == IFF_JFIF_JPEG)
+    ret = pixWriteMemJpeg (&picture->data, &picture->size, pix,
+			   list->jpeg_quality, 0);
+  else
+    ret = pixWriteMem (&picture->data, &picture->size, pix, format);
+
+  if (ret == 1)
+    {
+      error_quit ("Unable to compress picture.");
+    }
+
+  list->n++;
+  stats_count (COUNTER_PICTURES, 1);
+
+  pixDestroy (&pix);
+  pixDestroy (&clip);
+}
+
+PIX *
+read_page_text (const struct page_source *src, int page,
+		struct picture_list *pictures, int num_threads)
+{
+  int i;
+  struct timespec start;
+  stats_start (&start);
+
+  PIX *orig = read_page (src, page);
+  PIX *pixb = NULL;
+
+  stats_stop (STAGE_DECODE, &start, page);
+
+  if (orig == NULL)
+    return NULL;
+
+  if (pixGetDepth (orig) == 1)
+    {
+      pixb = pixClone (orig);
+    }
+  else if (src->binarize == BINARIZE_NONE)
+    {
+      /* Leave it for the caller to reject */
+      return orig;
+    }
+  else
+    {
+      stats_start (&start);
+      pixb = binarize_page (orig, src->binarize, num_threads);
+      stats_stop (STAGE_BINARIZE, &start, page);
+    }
+
+  if (!src->mixed)
+    {
+      pixDestroy (&orig);
+      return pixb;
+    }
+
+  /* Find the halftone/photo regions with leptonica's page segmentation */
+  stats_start (&start);
+  PIX *pixhm = NULL;
+  pixGetRegionsBinary (pixb, &pixhm, NULL, NULL, 0);
+
+  if (pixhm != NULL)
+    {
+      BOXA *boxa = pixConnComp (pixhm, NULL, 8);
+      l_int32 n = boxaGetCount (boxa);
+
+      /*
+         The whole bounding box goes into the picture, so clear it from
+         the text too, or anything inside it would be drawn twice.
+       */
+      for (i = 0; i < n; i++)
+	{
+	  BOX *box = boxaGetBox (boxa, i, L_CLONE);
+	  l_int32 x, y, w, h;
+
+	  boxGetGeometry (box, &x, &y, &w, &h);
+	  pixRasterop (pixb, x, y, w, h, PIX_CLR, NULL, 0, 0);
+
+	  if (pictures != NULL)
+	    {
+	      add_picture (pictures, orig, page, box);
+	    }
+
+	  boxDestroy (&box);
+	}
+
+      boxaDestroy (&boxa);
+      pixDestroy (&pixhm);
+    }
+
+  stats_stop (STAGE_SEGMENT, &start, page);
+
+  pixDestroy (&orig);
+
+  return pixb;
+}
+
+void
+print_page_name (const struct page_source *src, int page)
+{
+  int file = src->page_file[page];
+
+  if (src->file_pages[file] > 1)
+    {
+      printf ("%s (page %d of %d)", src->input_files[file],
+	      src->page_subpage[page] + 1, src->file_pages[file]);
+    }
+  else
+    {
+      printf ("%s", src->input_files[file]);
+    }
+}
+
+void
+destroy_page_source (struct page_source *src)
+{
+  free (src->file_pages);
+  free (src->file_is_tiff);
+  free (src->page_file);
+  free (src->page_subpage);
+  free (src->page_offset);
+  pthread_mutex_destroy (src->offset_lock);
+  free (src->offset_lock);
+  free (src->stdin_data);
+  free (src);
+}
+
+int
+otsu_threshold (NUMA * histo)
+{
+  int i;
+  double total = 0;
+  double sum = 0;
+
+  for (i = 0; i < 256; i++)
+    {
+      l_int32 count;
+      numaGetIValue (histo, i, &count);
+      total += count;
+      sum += (double) i *count;
+    }
+
+  /* Pick the split that maximizes the variance between the classes */
+  double weight_dark = 0;
+  double sum_dark = 0;
+  double best_var = -1;
+  int best = 127;
+
+  for (i = 0; i < 256; i++)
+    {
+      l_int32 count;
+      numaGetIValue (histo, i, &count);
+
+      weight_dark += count;
+      sum_dark += (double) i *count;
+
+      double weight_light = total - weight_dark;
+      if (weight_dark == 0 || weight_light == 0)
+	continue;
+
+      double mean_dark = sum_dark / weight_dark;
+      double mean_light = (sum - sum_dark) / weight_light;
+      double var = weight_dark * weight_light *
+	(mean_dark - mean_light) * (mean_dark - mean_light);
+
+      if (var > best_var)
+	{
+	  best_var = var;
+	  best = i;
+	}
+    }
+
+  return best;
+}
+
+#if defined (__x86_64__) && defined (__has_attribute)
+#if __has_attribute (target_clones)
+#define SAUVOLA_TARGETS __attribute__ ((target_clones ("avx2", "default")))
+#endif
+#endif
+#ifndef SAUVOLA_TARGETS
+#define SAUVOLA_TARGETS
+#endif
+
+/* A band of rows for one Sauvola binarization thread */
+struct sauvola_band
+{
+  PIX *pixg;			/* 8bpp input */
+  PIX *pixb;			/* 1bpp output */
+  l_int32 y0;			/* First row of the band */
+  l_int32 y1;			/* One past the last row */
+};
+
+/* Copy row y of the 8bpp pix into bytes, so the loops can vectorize */
+static void
+unpack_gray_row (PIX * pixg, l_int32 y, l_uint8 * row)
+{
+  l_int32 x;
+  l_int32 w = pixGetWidth (pixg);
+  l_uint32 *line = pixGetData (pixg) + y * pixGetWpl (pixg);
+
+  for (x = 0; x < w; x++)
+    row[x] = GET_DATA_BYTE (line, x);
+}
+
+/*
+  Sauvola's threshold for a window of n pixels that sums to s, and
+  whose squares sum to s2: t = m * (1 + k * (d / 128 - 1)), with m the
+  mean and d the standard deviation. Rounding can make the variance
+  slightly negative, fabsf keeps that branch free.
+*/
+static inline float
+sauvola_threshold (float s, float s2, float n)
+{
+  float mean = s / n;
+  float var = s2 / n - mean * mean;
+
+  return mean * (1.0f + SAUVOLA_K * (sqrtf (fabsf (var)) / 128.0f - 1.0f));
+}
+
+/* The threshold at x, for a window clipped by the edges of the row */
+static float
+clipped_sauvola_threshold (const l_uint32 * sum, const l_uint32 * sq,
+			   l_int32 x, l_int32 w, l_int32 rows)
+{
+  const l_int32 r = SAUVOLA_HALF_WINDOW;
+  l_int32 lo = (x - r < 0) ? 0 : x - r;
+  l_int32 hi = (x + r + 1 > w) ? w : x + r + 1;
+
+  return sauvola_threshold ((float) (l_int32) (sum[hi] - sum[lo]),
+			    (float) (l_int32) (sq[hi] - sq[lo]),
+			    (float) ((hi - lo) * rows));
+}
+
+/*
+  Binarize the rows of one band. The window sums are kept as an
+  integral image that slides down the band: colsum and colsq hold the
+  sums of each column over the window's rows, and get one row added
+  and one removed per output row. A prefix sum over them gives the
+  window sums along the row. This keeps the memory per thread
+  proportional to the page width, instead of a full page integral
+  image.
+
+  The prefix sums are allowed to wrap around: a window's sum fits in
+  32 bits, so the difference of two wrapped prefix sums is still
+  exact. Away from the left and right edges, every loop but the prefix
+  sum reads its arrays contiguously and has no branches, so the
+  compiler vectorizes them with the -ftree-vectorize and
+  -fno-math-errno Makefile.am builds with. The bit packing needs
+  AVX2's variable shifts, so on x86-64 there is also an AVX2 build of
+  the kernel, picked at load time on the machines that have it.
+*/
+SAUVOLA_TARGETS static void *
+sauvola_binarize_band (void *arg)
+{
+  struct sauvola_band *band = arg;
+  l_int32 x, y, i, b;
+  l_int32 w = pixGetWidth (band->pixg);
+  l_int32 h = pixGetHeight (band->pixg);
+  l_int32 wplb = pixGetWpl (band->pixb);
+  l_uint32 *datab = pixGetData (band->pixb);
+  const l_int32 r = SAUVOLA_HALF_WINDOW;
+
+  l_uint32 *restrict colsum = malloc_guarded (w * sizeof (l_uint32));
+  l_uint32 *restrict colsq = malloc_guarded (w * sizeof (l_uint32));
+  l_uint32 *restrict sum = malloc_guarded ((w + 1) * sizeof (l_uint32));
+  l_uint32 *restrict sq = malloc_guarded ((w + 1) * sizeof (l_uint32));
+  float *restrict thresh = malloc_guarded (w * sizeof (float));
+  l_uint8 *restrict row = malloc_guarded (w);
+  /* One byte per pixel of the output row, padded to whole words */
+  l_uint8 *restrict bits = malloc_guarded (32 * wplb);
+
+  memset (bits, 0, 32 * wplb);
+
+  /* The window is whole from x = r up to w - r - 1, clipped outside */
+  l_int32 xbegin = (r < w) ? r : w;
+  l_int32 xend = (w - r > xbegin) ? w - r : xbegin;
+
+  memset (colsum, 0, w * sizeof (l_uint32));
+  memset (colsq, 0, w * sizeof (l_uint32));
+
+  l_int32 ytop = (band->y0 - r < 0) ? 0 : band->y0 - r;
+  l_int32 ybot = (band->y0 + r >= h) ? h - 1 : band->y0 + r;
+
+  for (y = ytop; y <= ybot; y++)
+    {
+      unpack_gray_row (band->pixg, y, row);
+      for (x = 0; x < w; x++)
+	{
+	  colsum[x] += row[x];
+	  colsq[x] += (l_uint32) row[x] * row[x];
+	}
+    }
+
+  for (y = band->y0; y < band->y1; y++)
+    {
+      /* Slide the window down a row */
+      if (y > band->y0)
+	{
+	  if (y + r < h)
+	    {
+	      unpack_gray_row (band->pixg, y + r, row);
+	      for (x = 0; x < w; x++)
+		{
+		  colsum[x] += row[x];
+		  colsq[x] += (l_uint32) row[x] * row[x];
+		}
+	    }
+	  if (y - r - 1 >= 0)
+	    {
+	      unpack_gray_row (band->pixg, y - r - 1, row);
+	      for (x = 0; x < w; x++)
+		{
+		  colsum[x] -= row[x];
+		  colsq[x] -= (l_uint32) row[x] * row[x];
+		}
+	    }
+	}
+
+      ytop = (y - r < 0) ? 0 : y - r;
+      ybot = (y + r >= h) ? h - 1 : y + r;
+      l_int32 rows = ybot - ytop + 1;
+
+      sum[0] = 0;
+      sq[0] = 0;
+      for (x = 0; x < w; x++)
+	{
+	  sum[x + 1] = sum[x] + colsum[x];
+	  sq[x + 1] = sq[x] + colsq[x];
+	}
+
+      float n = (float) ((2 * r + 1) * rows);
+
+      for (x = xbegin; x < xend; x++)
+	{
+	  thresh[x] =
+	    sauvola_threshold ((float) (l_int32) (sum[x + r + 1] - sum[x - r]),
+			       (float) (l_int32) (sq[x + r + 1] - sq[x - r]),
+			       n);
+	}
+
+      /* The few pixels near the edges, with the window clipped */
+      for (x = 0; x < xbegin; x++)
+	thresh[x] = clipped_sauvola_threshold (sum, sq, x, w, rows);
+      for (x = xend; x < w; x++)
+	thresh[x] = clipped_sauvola_threshold (sum, sq, x, w, rows);
+
+      unpack_gray_row (band->pixg, y, row);
+      for (x = 0; x < w; x++)
+	bits[x] = row[x] < thresh[x];
+
+      /* Leptonica keeps the leftmost pixel in the high bit */
+      l_uint32 *lineb = datab + y * wplb;
+
+      for (i = 0; i < wplb; i++)
+	{
+	  const l_uint8 *wordbits = bits + 32 * i;
+	  l_uint32 word = 0;
+
+	  for (b = 0; b < 32; b++)
+	    word |= (l_uint32) wordbits[b] << (31 - b);
+	  lineb[i] = word;
+	}
+    }
+
+  free (colsum);
+  free (colsq);
+  free (sum);
+  free (sq);
+  free (thresh);
+  free (row);
+  free (bits);
+
+  return NULL;
+}
+
+PIX *
+binarize_page (PIX * page, int method, int num_threads)
+{
+  int i;
+  PIX *pixg = pixConvertTo8 (page, 0);
+
+  if (pixg == NULL)
+    {
+      error_quit ("Unable to convert page to grayscale.");
+    }
+
+  if (method == BINARIZE_OTSU)
+    {
+      NUMA *histo = pixGetGrayHistogram (pixg, 1);
+      int thresh = otsu_threshold (histo);
+      numaDestroy (&histo);
+
+      /* Pixels darker than the threshold become black */
+      PIX *pixb = pixThresholdToBinary (pixg, thresh + 1);
+      pixDestroy (&pixg);
+
+      return pixb;
+    }
+
+  l_int32 w = pixGetWidth (pixg);
+  l_int32 h = pixGetHeight (pixg);
+  PIX *pixb = pixCreate (w, h, 1);
+
+  if (pixb == NULL)
+    {
+      error_quit ("Out of memory.");
+    }
+
+  /* Each thread binarizes its own band of rows */
+  if (num_threads > h)
+    num_threads = h;
+
+  struct sauvola_band *bands =
+    malloc_guarded (num_threads * sizeof (struct sauvola_band));
+  pthread_t *threads = malloc_guarded (num_threads * sizeof (pthread_t));
+
+  for (i = 0; i < num_threads; i++)
+    {
+      bands[i].pixg = pixg;
+      bands[i].pixb = pixb;
+      bands[i].y0 = (l_int32) ((long) h * i / num_threads);
+      bands[i].y1 = (l_int32) ((long) h * (i + 1) / num_threads);
+
+      if (pthread_create (&threads[i], NULL, sauvola_binarize_band,
+			  &bands[i]) != 0)
+	{
+	  error_quit ("Unable to start binarization thread.");
+	}
+    }
+
+  for (i = 0; i < num_threads; i++)
+    {
+      pthread_join (threads[i], NULL);
+    }
+
+  free (bands);
+  free (threads);
+  pixDestroy (&pixg);
+
+  return pixb;
+}
+
+JBDATA *
+classify_components (const struct page_source *pages,
+		     struct picture_list *pictures,
+		     struct class_averages *averages, double thresh,
+		     double weight, size_t template_memory,
+		     struct template_store **store)
+{
+
+  /* JBCLASSER* classer = jbCorrelationInit(JB_CONN_COMPS, 9999, 9999, thresh, weight); */
+  JBCLASSER *classer =
+    jbCorrelationInitWithoutComponents (JB_CONN_COMPS, 9999, 9999, thresh,
+					weight);
+
+  if (classer == NULL)
+    {
+      error_quit ("Unable to create leptonica JBCLASSER.");
+    }
+
+  int i;
+  struct timespec start;
+
+  /* Pages are decoded one at a time, and freed once classified */
+  for (i = 0; i < pages->num_pages; i++)
+    {
+      PIX *page = read_page_text (pages, i, pictures, pages->num_threads);
 
       if (page == NULL)
 	{
-	  printf ("Problem with page %s\n", input_files[i]);
-	  error_quit ("Unable to read Page");
+	  printf ("Problem with page ");
+	  print_page_name (pages, i);
+	  printf ("\n");
+	  error_quit ("Unable to read Page");
+	}
+
+      if (pixGetDepth (page) != 1)
+	{
+	  printf ("Input page ");
+	  print_page_name (pages, i);
+	  printf (" is not 1bpp\n");
+	  error_quit
+	    ("Only 1bpp (black and white) images are supported with --binarize none.");
+	}
+
+      l_int32 ncomp = numaGetCount (classer->naclass);
+      stats_start (&start);
+
+      if (jbAddPage (classer, page) == 1)
+	{
+	  printf ("Problem with page ");
+	  print_page_name (pages, i);
+	  printf ("\n");
+	  error_quit ("Unable to add page to JBCLASSIFIER.");
+	}
+
+      stats_stop (STAGE_CLASSIFY, &start, i);
+      stats_page (i, numaGetCount (classer->naclass) - ncomp,
+		  classer->nclass);
+
+      if (averages != NULL)
+	{
+	  add_to_class_averages (averages, classer, page, ncomp);
+	}
+
+      pixDestroy (&page);
+    }
+
+  stats_start (&start);
+
+  /* Each glyph is saved separately, in the template store */
+  JBDATA *data = save_classes (classer, template_memory, store);
+
+  stats_stop (STAGE_JBDATA_SAVE, &start, -1);
+  stats_count (COUNTER_CLASSES, data->nclass);
+
+  jbClasserDestroy (&classer);
+
+  if (pictures != NULL)
+    {
+      printf ("%d picture regions\n", pictures->n);
+    }
+
+  return data;
+}
+
+struct class_averages *
+create_class_averages ()
+{
+  struct class_averages *averages =
+    malloc_guarded (sizeof (struct class_averages));
+
+  averages->n = 0;
+  averages->capacity = 256;
+  averages->w = malloc_guarded (averages->capacity * sizeof (l_int32));
+  averages->h = malloc_guarded (averages->capacity * sizeof (l_int32));
+  averages->count = malloc_guarded (averages->capacity * sizeof (l_uint32));
+  averages->sums = malloc_guarded (averages->capacity * sizeof (l_uint32 *));
+
+  return averages;
+}
+
+void
+destroy_class_averages (struct class_averages *averages)
+{
+  int i;
+
+  for (i = 0; i < averages->n; i++)
+    {
+      free (averages->sums[i]);
+    }
+
+  free (averages->w);
+  free (averages->h);
+  free (averages->count);
+  free (averages->sums);
+  free (averages);
+}
+
+void
+add_to_class_averages (struct class_averages *averages,
+		       const JBCLASSER * classer, PIX * page, l_int32 first)
+{
+  l_int32 i, x, y, xx, yy;
+  l_int32 ncomp = numaGetCount (classer->naclass);
+  l_int32 w = pixGetWidth (page);
+  l_int32 h = pixGetHeight (page);
+  l_int32 wpl = pixGetWpl (page);
+  l_uint32 *page_data = pixGetData (page);
+
+  /* New classes start out empty, the size of their template */
+  while (averages->n < classer->nclass)
+    {
+      int n = averages->n;
+
+      if (n == averages->capacity)
+	{
+	  averages->capacity *= 2;
+	  averages->w = realloc_guarded (averages->w, averages->capacity *
+					 sizeof (l_int32));
+	  averages->h = realloc_guarded (averages->h, averages->capacity *
+					 sizeof (l_int32));
+	  averages->count = realloc_guarded (averages->count,
+					     averages->capacity *
+					     sizeof (l_uint32));
+	  averages->sums = realloc_guarded (averages->sums,
+					    averages->capacity *
+					    sizeof (l_uint32 *));
+	}
+
+      PIX *pix = classer->pixat->pix[n];
+      size_t size = pixGetWidth (pix) * pixGetHeight (pix);
+
+      averages->w[n] = pixGetWidth (pix);
+      averages->h[n] = pixGetHeight (pix);
+      averages->count[n] = 0;
+      averages->sums[n] = malloc_guarded (size * sizeof (l_uint32));
+      memset (averages->sums[n], 0, size * sizeof (l_uint32));
+      averages->n++;
+    }
+
+  /* The instance is what is under its template, where it is drawn */
+  for (i = first; i < ncomp; i++)
+    {
+      l_int32 iclass;
+
+      numaGetIValue (classer->naclass, i, &iclass);
+      ptaGetIPt (classer->ptaul, i, &x, &y);
+
+      l_int32 tw = averages->w[iclass];
+      l_int32 th = averages->h[iclass];
+      l_uint32 *sums = averages->sums[iclass];
+
+      for (yy = 0; yy < th; yy++)
+	{
+	  if (y + yy < 0 || y + yy >= h)
+	    continue;
+
+	  l_uint32 *line = page_data + (y + yy) * wpl;
+
+	  for (xx = 0; xx < tw; xx++)
+	    {
+	      if (x + xx >= 0 && x + xx < w && GET_DATA_BIT (line, x + xx))
+		sums[yy * tw + xx]++;
+	    }
+	}
+
+      averages->count[iclass]++;
+    }
+}
+
+/* Black where at least half of the class's instances are */
+static PIX *
+averaged_template (const struct class_averages *averages, int iclass)
+{
+  l_int32 x, y;
+  l_int32 w = averages->w[iclass];
+  l_int32 h = averages->h[iclass];
+  const l_uint32 *sums = averages->sums[iclass];
+  PIX *pix = pixCreate (w, h, 1);
+  l_int32 wpl = pixGetWpl (pix);
+  l_uint32 *data = pixGetData (pix);
+
+  for (y = 0; y < h; y++)
+    {
+      l_uint32 *line = data + y * wpl;
+
+      for (x = 0; x < w; x++)
+	{
+	  if (2 * sums[y * w + x] >= averages->count[iclass])
+	    SET_DATA_BIT (line, x);
+	}
+    }
+
+  return pix;
+}
+
+/*
+  Template i of store, put back into the w by h frame of the
+  classifier's template, border and all, which the averages share.
+  The store only keeps the part clipped to the foreground.
+*/
+static PIX *
+framed_template (const struct template_store *store, int i, l_int32 w,
+		 l_int32 h)
+{
+  l_int32 x, y;
+  PIX *clip = template_store_get (store, i, &x, &y);
+  PIX *pix = pixCreate (w, h, 1);
+
+  pixRasterop (pix, x, y, pixGetWidth (clip), pixGetHeight (clip), PIX_SRC,
+	       clip, 0, 0);
+  pixDestroy (&clip);
+
+  return pix;
+}
+
+/* For sorting the classes, most instances first */
+struct class_rank
+{
+  l_uint32 count;
+  int iclass;
+};
+
+static int
+compare_class_rank (const void *a, const void *b)
+{
+  const struct class_rank *ra = a;
+  const struct class_rank *rb = b;
+
+  if (ra->count != rb->count)
+    return ra->count > rb->count ? -1 : 1;
+
+  return ra->iclass - rb->iclass;
+}
+
+int
+consolidate_classes (JBDATA * data, struct template_store **store,
+		     const struct class_averages *averages, double thresh,
+		     double weight)
+{
+  int i, j;
+  int nclass = data->nclass;
+  l_int32 ncomp = numaGetCount (data->naclass);
+  struct timespec start;
+  stats_start (&start);
+
+  l_int32 *sumtab = makePixelSumTab8 ();
+  l_int32 *centtab = makePixelCentroidTab8 ();
+
+  PIXA *refined = pixaCreate (nclass);
+  l_int32 *area = malloc_guarded (nclass * sizeof (l_int32));
+  l_float32 *cx = malloc_guarded (nclass * sizeof (l_float32));
+  l_float32 *cy = malloc_guarded (nclass * sizeof (l_float32));
+  struct class_rank *ranks =
+    malloc_guarded (nclass * sizeof (struct class_rank));
+
+  for (i = 0; i < nclass; i++)
+    {
+      PIX *pix;
+
+      /* Both in the same frame, so sizes and centroids compare */
+      if (averages->count[i] < CONSOLIDATE_MIN_INSTANCES)
+	pix = framed_template (*store, i, averages->w[i], averages->h[i]);
+      else
+	pix = averaged_template (averages, i);
+
+      pixCountPixels (pix, &area[i], sumtab);
+      pixCentroid (pix, centtab, sumtab, &cx[i], &cy[i]);
+      pixaAddPix (refined, pix, L_INSERT);
+
+      ranks[i].count = averages->count[i];
+      ranks[i].iclass = i;
+    }
+
+  qsort (ranks, nclass, sizeof (struct class_rank), compare_class_rank);
+
+  /*
+     The most common classes become the representatives, and every
+     other class joins the first one it matches. Representatives are
+     never merged themselves, so merges can't chain from one letter
+     to another.
+   */
+  int *rep = malloc_guarded (nclass * sizeof (int));
+  int *reps = malloc_guarded (nclass * sizeof (int));
+  int *merged = malloc_guarded (nclass * sizeof (int));
+  int num_reps = 0;
+
+  for (i = 0; i < nclass; i++)
+    {
+      int iclass = ranks[i].iclass;
+      PIX *pix = refined->pix[iclass];
+
+      rep[iclass] = iclass;
+      merged[iclass] = 0;
+
+      for (j = 0; j < num_reps && area[iclass] > 0; j++)
+	{
+	  int r = reps[j];
+	  PIX *rpix = refined->pix[r];
+	  l_float32 score;
+
+	  /* Same size tolerance leptonica's classifier uses */
+	  if (abs (pixGetWidth (rpix) - pixGetWidth (pix)) > 2
+	      || abs (pixGetHeight (rpix) - pixGetHeight (pix)) > 2)
+	    continue;
+
+	  double threshold = thresh + (1.0 - thresh) * weight *
+	    area[r] / (double) (pixGetWidth (rpix) * pixGetHeight (rpix));
+
+	  pixCorrelationScore (pix, rpix, area[iclass], area[r],
+			       cx[iclass] - cx[r], cy[iclass] - cy[r], 2, 2,
+			       sumtab, &score);
+
+	  if (score >= threshold)
+	    {
+	      rep[iclass] = r;
+	      merged[r] = 1;
+	      break;
+	    }
+	}
+
+      if (rep[iclass] == iclass)
+	reps[num_reps++] = iclass;
+    }
+
+  /* The classes that are left keep their order */
+  int *new_class = malloc_guarded (nclass * sizeof (int));
+  struct template_store *kept =
+    create_template_store ((*store)->memory_limit);
+  int n = 0;
+
+  for (i = 0; i < nclass; i++)
+    {
+      if (rep[i] != i)
+	continue;
+
+      new_class[i] = n++;
+
+      /*
+         The average only stands in for the classes it took in. Either
+         way the template is added in the classifier's frame, so the
+         store clips it to the same offset as before.
+       */
+      if (merged[i])
+	{
+	  template_store_add (kept, refined->pix[i]);
+	}
+      else
+	{
+	  PIX *pix = framed_template (*store, i, averages->w[i],
+				      averages->h[i]);
+	  template_store_add (kept, pix);
+	  pixDestroy (&pix);
+	}
+    }
+
+  finish_template_store (kept);
+
+  /* Merged instances are moved so the centroids still line up */
+  for (i = 0; i < ncomp; i++)
+    {
+      l_int32 iclass;
+      l_float32 x, y;
+
+      numaGetIValue (data->naclass, i, &iclass);
+      numaSetValue (data->naclass, i, new_class[rep[iclass]]);
+
+      if (rep[iclass] != iclass)
+	{
+	  ptaGetPt (data->ptaul, i, &x, &y);
+	  ptaSetPt (data->ptaul, i,
+		    x + (l_int32) floor (cx[iclass] - cx[rep[iclass]] + 0.5),
+		    y + (l_int32) floor (cy[iclass] - cy[rep[iclass]] + 0.5));
+	}
+    }
+
+  /* The merged classes' templates replace the first instances */
+  destroy_template_store (*store);
+  *store = kept;
+  data->nclass = num_reps;
+
+  int removed = nclass - num_reps;
+  printf ("Consolidation merged %d of %d classes, %d left\n", removed,
+	  nclass, num_reps);
+  stats_count (COUNTER_CLASSES_MERGED, removed);
+
+  pixaDestroy (&refined);
+  free (new_class);
+  free (merged);
+  free (reps);
+  free (rep);
+  free (ranks);
+  free (cy);
+  free (cx);
+  free (area);
+  free (centtab);
+  free (sumtab);
+
+  stats_stop (STAGE_CONSOLIDATE, &start, -1);
+
+  return removed;
+}
+
+int
+register_mappings (const JBDATA * data, const struct ocr_result *ocr,
+		   struct mapping **in_maps)
+{
+  int i;
+  struct timespec start;
+  stats_start (&start);
+
+  /* Register mappings for each component */
+  l_int32 ncomp = numaGetCount (data->naclass);
+
+  *in_maps = malloc_guarded (ncomp * sizeof (struct mapping));
+  struct mapping *maps = *in_maps;
+  for (i = 0; i < ncomp; i++)
+    {
+      maps[i].used = 0;
+    }
+
+  /* Which code points of each font are already taken */
+  int num_fonts = 1;
+  unsigned char (*taken)[256] = malloc_guarded (sizeof (*taken));
+  memset (taken, 0, sizeof (*taken));
+
+  /* The fonts it takes to hold every class anyway */
+  int codes_per_font = 1;
+  unsigned char c;
+
+  for (c = first_code_point (); c != max_code_point ();
+       c = next_code_point (c))
+    codes_per_font++;
+
+  int fonts_needed = (data->nclass + codes_per_font - 1) / codes_per_font;
+
+  if (fonts_needed < 1)
+    fonts_needed = 1;
+
+  num_fonts = fonts_needed;
+  taken = realloc_guarded (taken, num_fonts * sizeof (*taken));
+  memset (taken, 0, num_fonts * sizeof (*taken));
+
+  /*
+     Recognized ASCII characters get their own code point, as long as
+     one is free in those fonts. A noisy book has many variants of a
+     letter, and a font for each would cost a fontforge run and a font
+     object. The rest are still searchable through ToUnicode.
+   */
+  for (i = 0; ocr != NULL && i < data->nclass; i++)
+    {
+      if (ocr[i].len != 1 || ocr[i].chars[0] < first_code_point ()
+	  || ocr[i].chars[0] > '~')
+	continue;
+
+      c = ocr[i].chars[0];
+      int font_num = 0;
+
+      while (font_num < num_fonts && taken[font_num][c])
+	font_num++;
+
+      if (font_num == num_fonts)
+	continue;
+
+      maps[i].iclass = i;
+      maps[i].font_num = font_num;
+      maps[i].code_point = c;
+      maps[i].used = 1;
+      taken[font_num][c] = 1;
+    }
+
+  /* Everything else fills the free code points, in order */
+  unsigned char code_point = first_code_point ();
+  int font_num = 0;
+
+  for (i = 0; i < data->nclass; i++)
+    {
+      l_int32 iclass = i;
+
+      if (maps[iclass].used)
+	continue;
+
+      while (font_num < num_fonts && taken[font_num][code_point])
+	{
+	  if (code_point == max_code_point ())
+	    {
+	      code_point = first_code_point ();
+	      font_num++;
+	    }
+	  else
+	    {
+	      code_point = next_code_point (code_point);
+	    }
+	}
+
+      if (font_num == num_fonts)
+	{
+	  num_fonts++;
+	  taken = realloc_guarded (taken, num_fonts * sizeof (*taken));
+	  memset (taken[font_num], 0, sizeof (*taken));
+	}
+
+      maps[iclass].iclass = iclass;
+      maps[iclass].font_num = font_num;
+      maps[iclass].code_point = code_point;
+      maps[iclass].used = 1;
+      taken[font_num][code_point] = 1;
+    }
+
+  free (taken);
+  printf ("%d fonts\n", num_fonts);
+
+  stats_stop (STAGE_MAPPING, &start, -1);
+
+  return num_fonts;
+}
+
+/* One page's results, from verify_pages */
+struct verify_page
+{
+  l_int32 foreground;		/* Black pixels of the original */
+  l_int32 xor_pixels;		/* Pixels the rendering gets wrong */
+  double error;			/* xor_pixels / foreground */
+  int substitutions;
+  int flagged;			/* 1 to write a heatmap */
+};
+
+/* The pages are shared out between the threads as they finish them */
+struct verify_job
+{
+  const struct page_source *pages;
+  const JBDATA *data;
+  PIXA *templates;
+  const l_int32 *page_start;	/* First component of each page */
+  double threshold;
+  const char *outdir;
+  int write_heatmaps;		/* 0 to measure, 1 for the heatmaps */
+
+  double *component_error;
+  struct verify_page *results;
+
+  pthread_mutex_t lock;
+  int next_page;
+};
+
+PIX *
+render_templates (const JBDATA * data, PIXA * templates, l_int32 first,
+		  l_int32 last, l_int32 w, l_int32 h)
+{
+  PIX *pixd = pixCreate (w, h, 1);
+  l_int32 i;
+
+  for (i = first; i < last; i++)
+    {
+      l_int32 iclass, x, y;
+
+      numaGetIValue (data->naclass, i, &iclass);
+      ptaGetIPt (data->ptaul, i, &x, &y);
+
+      /*
+         Use the pix and box directly, cloning them would race on the
+         refcount.
+       */
+      PIX *pix = templates->pix[iclass];
+      BOX *box = templates->boxa->box[iclass];
+
+      pixRasterop (pixd, x + box->x, y + box->y, box->w, box->h,
+		   PIX_SRC | PIX_DST, pix, 0, 0);
+    }
+
+  return pixd;
+}
+
+/*
+  How far component i's template is from what is on the page under
+  it: the differing pixels over the black pixels of both, from 0 for
+  a perfect match to 1 when they don't overlap at all.
+*/
+static double
+component_error (const JBDATA * data, PIXA * templates, PIX * orig,
+		 l_int32 i, l_int32 * sumtab)
+{
+  l_int32 iclass, x, y;
+  l_int32 orig_count, template_count, xor_count;
+
+  numaGetIValue (data->naclass, i, &iclass);
+  ptaGetIPt (data->ptaul, i, &x, &y);
+
+  PIX *pix = templates->pix[iclass];
+  BOX *tbox = templates->boxa->box[iclass];
+  BOX *box = boxCreate (x + tbox->x, y + tbox->y, tbox->w, tbox->h);
+  PIX *clip = pixClipRectangle (orig, box, NULL);
+
+  boxDestroy (&box);
+
+  if (clip == NULL)
+    return 1.0;
+
+  pixCountPixels (clip, &orig_count, sumtab);
+  pixCountPixels (pix, &template_count, sumtab);
+  pixRasterop (clip, 0, 0, tbox->w, tbox->h, PIX_SRC ^ PIX_DST, pix, 0, 0);
+  pixCountPixels (clip, &xor_count, sumtab);
+  pixDestroy (&clip);
+
+  if (orig_count + template_count == 0)
+    return 0.0;
+
+  return (double) xor_count / (orig_count + template_count);
+}
+
+/*
+  Light gray for the original, red where the rendering misses
+  pixels, and blue where it adds them.
+*/
+static void
+write_heatmap (const char *outdir, int page, PIX * orig, PIX * rendered)
+{
+  l_int32 w, h;
+  l_uint32 gray, red, blue;
+  char name[64];
+
+  pixGetDimensions (orig, &w, &h, NULL);
+  composeRGBPixel (208, 208, 208, &gray);
+  composeRGBPixel (255, 0, 0, &red);
+  composeRGBPixel (0, 0, 255, &blue);
+
+  PIX *missing = pixSubtract (NULL, orig, rendered);
+  PIX *extra = pixSubtract (NULL, rendered, orig);
+  PIX *heat = pixCreate (w, h, 32);
+
+  pixSetAll (heat);
+  pixPaintThroughMask (heat, orig, 0, 0, gray);
+  pixPaintThroughMask (heat, missing, 0, 0, red);
+  pixPaintThroughMask (heat, extra, 0, 0, blue);
+
+  sprintf (name, "heatmap-%05d.png", page + 1);
+  char *path = malloc_guarded (strlen (outdir) + 1 + strlen (name) + 1);
+  sprintf (path, "%s/%s", outdir, name);
+
+  if (pixWrite (path, heat, IFF_PNG) == 1)
+    {
+      printf ("Failed to write %s.\n", path);
+      error_quit ("Could not write heatmap.");
+    }
+
+  free (path);
+  pixDestroy (&heat);
+  pixDestroy (&extra);
+  pixDestroy (&missing);
+}
+
+static void *
+verify_page_range (void *arg)
+{
+  struct verify_job *job = arg;
+  l_int32 *sumtab = makePixelSumTab8 ();
+  struct timespec start;
+
+  while (1)
+    {
+      pthread_mutex_lock (&job->lock);
+      int page = job->next_page++;
+      pthread_mutex_unlock (&job->lock);
+
+      if (page >= job->pages->num_pages)
+	break;
+
+      struct verify_page *result = &job->results[page];
+
+      if (job->write_heatmaps && !result->flagged)
+	continue;
+
+      /*
+         Compare with the text the classifier saw, without pictures.
+         The workers already run a page each, so no more threads.
+       */
+      PIX *orig = read_page_text (job->pages, page, NULL, 1);
+
+      if (orig == NULL || pixGetDepth (orig) != 1)
+	{
+	  error_quit ("Unable to read page again for --verify.");
+	}
+
+      stats_start (&start);
+
+      l_int32 w, h, i;
+      l_int32 first = job->page_start[page];
+      l_int32 last = job->page_start[page + 1];
+
+      pixGetDimensions (orig, &w, &h, NULL);
+      PIX *rendered =
+	render_templates (job->data, job->templates, first, last, w, h);
+
+      if (job->write_heatmaps)
+	{
+	  write_heatmap (job->outdir, page, orig, rendered);
+	}
+      else
+	{
+	  PIX *xor = pixXor (NULL, orig, rendered);
+
+	  pixCountPixels (orig, &result->foreground, sumtab);
+	  pixCountPixels (xor, &result->xor_pixels, sumtab);
+	  result->error = (double) result->xor_pixels /
+	    (result->foreground > 0 ? result->foreground : 1);
+	  result->substitutions = 0;
+
+	  for (i = first; i < last; i++)
+	    {
+	      job->component_error[i] =
+		component_error (job->data, job->templates, orig, i, sumtab);
+
+	      if (job->component_error[i] > job->threshold)
+		result->substitutions++;
+	    }
+
+	  pixDestroy (&xor);
+	}
+
+      pixDestroy (&rendered);
+      pixDestroy (&orig);
+
+      stats_stop (STAGE_VERIFY, &start, page);
+    }
+
+  free (sumtab);
+
+  return NULL;
+}
+
+static void
+run_verify_threads (struct verify_job *job, int num_threads)
+{
+  int i;
+  pthread_t *threads = malloc_guarded (num_threads * sizeof (pthread_t));
+
+  job->next_page = 0;
+
+  for (i = 0; i < num_threads; i++)
+    {
+      if (pthread_create (&threads[i], NULL, verify_page_range, job) != 0)
+	{
+	  error_quit ("Unable to create verify thread.");
+	}
+    }
+
+  for (i = 0; i < num_threads; i++)
+    {
+      pthread_join (threads[i], NULL);
+    }
+
+  free (threads);
+}
+
+l_int32 *
+component_page_starts (const JBDATA * data, int num_pages)
+{
+  int i;
+  l_int32 ncomp = numaGetCount (data->naclass);
+  l_int32 *page_start = malloc_guarded ((num_pages + 1) * sizeof (l_int32));
+  l_int32 comp = 0;
+
+  /* The components are in page order */
+  for (i = 0; i < num_pages; i++)
+    {
+      l_int32 ipage = i;
+
+      page_start[i] = comp;
+      while (comp < ncomp)
+	{
+	  numaGetIValue (data->napage, comp, &ipage);
+	  if (ipage != i)
+	    break;
+	  comp++;
+	}
+    }
+  page_start[num_pages] = ncomp;
+
+  return page_start;
+}
+
+static void
+write_json_string (FILE * out, const char *str)
+{
+  fputc ('"', out);
+  for (; *str != '\0'; str++)
+    {
+      if (*str == '"' || *str == '\\')
+	fputc ('\\', out);
+      if ((unsigned char) *str >= 0x20)
+	fputc (*str, out);
+    }
+  fputc ('"', out);
+}
+
+int
+verify_pages (const struct page_source *pages, const JBDATA * data,
+	      const struct template_store *store, const char *outdir,
+	      double threshold, int num_threads)
+{
+  int i;
+  int num_pages = pages->num_pages;
+  l_int32 ncomp = numaGetCount (data->naclass);
+
+  if (mkdir (outdir, 0755) == -1 && errno != EEXIST)
+    {
+      printf ("Failed to create %s.\n", outdir);
+      error_quit ("Could not create verify directory.");
+    }
+
+  struct verify_job job;
+
+  job.pages = pages;
+  job.data = data;
+  job.templates = extract_templates (store);
+  job.threshold = threshold;
+  job.outdir = outdir;
+  job.component_error = malloc_guarded ((ncomp > 0 ? ncomp : 1) *
+					sizeof (double));
+  job.results = malloc_guarded (num_pages * sizeof (struct verify_page));
+  pthread_mutex_init (&job.lock, NULL);
+
+  l_int32 *page_start = component_page_starts (data, num_pages);
+  l_int32 comp;
+  job.page_start = page_start;
+
+  if (num_threads > num_pages)
+    num_threads = num_pages;
+  if (num_threads < 1)
+    num_threads = 1;
+
+  job.write_heatmaps = 0;
+  run_verify_threads (&job, num_threads);
+
+  /* Outliers have substitutions, or far more error than the rest */
+  double mean = 0;
+  double variance = 0;
+  int worst = 0;
+  int num_substitutions = 0;
+  int num_flagged = 0;
+
+  for (i = 0; i < num_pages; i++)
+    {
+      mean += job.results[i].error / num_pages;
+      if (job.results[i].error > job.results[worst].error)
+	worst = i;
+    }
+  for (i = 0; i < num_pages; i++)
+    {
+      double d = job.results[i].error - mean;
+      variance += d * d / num_pages;
+    }
+
+  for (i = 0; i < num_pages; i++)
+    {
+      struct verify_page *result = &job.results[i];
+
+      result->flagged = result->substitutions > 0
+	|| (num_pages > 1 && result->error > mean + 3 * sqrt (variance));
+      num_substitutions += result->substitutions;
+      num_flagged += result->flagged;
+    }
+
+  job.write_heatmaps = 1;
+  run_verify_threads (&job, num_threads);
+
+  stats_count (COUNTER_SUBSTITUTIONS, num_substitutions);
+
+  /* The report */
+  char *path = malloc_guarded (strlen (outdir) + strlen ("/verify.json") + 1);
+  sprintf (path, "%s/verify.json", outdir);
+  FILE *out = fopen (path, "w");
+
+  if (out == NULL)
+    {
+      printf ("Failed to open %s.\n", path);
+      error_quit ("Could not write verify report.");
+    }
+
+  fprintf (out, "{\n");
+  fprintf (out, "  \"threshold\": %g,\n", threshold);
+  fprintf (out, "  \"mean_page_error\": %.6f,\n", mean);
+  fprintf (out, "  \"substitutions\": %d,\n", num_substitutions);
+
+  fprintf (out, "  \"pages\": [\n");
+  for (i = 0; i < num_pages; i++)
+    {
+      const struct verify_page *result = &job.results[i];
+      int file = pages->page_file[i];
+
+      fprintf (out, "    {\"page\": %d, \"file\": ", i + 1);
+      write_json_string (out, pages->input_files[file]);
+      fprintf (out, ", \"subpage\": %d, \"foreground\": %d, "
+	       "\"xor_pixels\": %d, \"error\": %.6f, \"substitutions\": %d, "
+	       "\"heatmap\": ", pages->page_subpage[i] + 1,
+	       result->foreground, result->xor_pixels, result->error,
+	       result->substitutions);
+      if (result->flagged)
+	fprintf (out, "\"heatmap-%05d.png\"", i + 1);
+      else
+	fprintf (out, "null");
+      fprintf (out, "}%s\n", i + 1 < num_pages ? "," : "");
+    }
+  fprintf (out, "  ],\n");
+
+  /* Each class, over all its components */
+  int nclass = data->nclass > 0 ? data->nclass : 1;
+  int *class_count = malloc_guarded (nclass * sizeof (int));
+  int *class_substitutions = malloc_guarded (nclass * sizeof (int));
+  double *class_sum = malloc_guarded (nclass * sizeof (double));
+  double *class_max = malloc_guarded (nclass * sizeof (double));
+
+  for (i = 0; i < data->nclass; i++)
+    {
+      class_count[i] = 0;
+      class_substitutions[i] = 0;
+      class_sum[i] = 0;
+      class_max[i] = 0;
+    }
+
+  for (comp = 0; comp < ncomp; comp++)
+    {
+      l_int32 iclass;
+      double error = job.component_error[comp];
+
+      numaGetIValue (data->naclass, comp, &iclass);
+      class_count[iclass]++;
+      class_sum[iclass] += error;
+      if (error > class_max[iclass])
+	class_max[iclass] = error;
+      if (error > threshold)
+	class_substitutions[iclass]++;
+    }
+
+  fprintf (out, "  \"classes\": [\n");
+  for (i = 0; i < data->nclass; i++)
+    {
+      fprintf (out, "    {\"class\": %d, \"components\": %d, "
+	       "\"mean_error\": %.6f, \"max_error\": %.6f, "
+	       "\"substitutions\": %d}%s\n", i, class_count[i],
+	       class_count[i] > 0 ? class_sum[i] / class_count[i] : 0.0,
+	       class_max[i], class_substitutions[i],
+	       i + 1 < data->nclass ? "," : "");
+    }
+  fprintf (out, "  ],\n");
+
+  /* Where the flagged components are, to look at them */
+  int num_written = 0;
+
+  fprintf (out, "  \"flagged\": [\n");
+  for (i = 0; i < num_pages; i++)
+    {
+      for (comp = page_start[i]; comp < page_start[i + 1]; comp++)
+	{
+	  l_int32 iclass, x, y;
+
+	  if (job.component_error[comp] <= threshold)
+	    continue;
+
+	  numaGetIValue (data->naclass, comp, &iclass);
+	  ptaGetIPt (data->ptaul, comp, &x, &y);
+
+	  BOX *box = job.templates->boxa->box[iclass];
+
+	  fprintf (out, "    {\"page\": %d, \"class\": %d, \"x\": %d, "
+		   "\"y\": %d, \"w\": %d, \"h\": %d, \"error\": %.6f}%s\n",
+		   i + 1, iclass, x + box->x, y + box->y, box->w, box->h,
+		   job.component_error[comp],
+		   ++num_written < num_substitutions ? "," : "");
+	}
+    }
+  fprintf (out, "  ]\n");
+  fprintf (out, "}\n");
+
+  if (fclose (out) != 0)
+    {
+      error_quit ("Could not write verify report.");
+    }
+
+  printf ("Verify: mean page error %.4f, worst page %d (%.4f)\n", mean,
+	  worst + 1, num_pages > 0 ? job.results[worst].error : 0.0);
+  printf ("%d substitutions flagged, %d heatmaps written, report in %s\n",
+	  num_substitutions, num_flagged, path);
+
+  free (class_count);
+  free (class_substitutions);
+  free (class_sum);
+  free (class_max);
+  free (path);
+  free (page_start);
+  free (job.results);
+  free (job.component_error);
+  pthread_mutex_destroy (&job.lock);
+  pixaDestroy (&job.templates);
+
+  return num_flagged;
+}
+
+/* One setting --auto-tune tries, and how it does on the sample */
+struct tune_setting
+{
+  double thresh;
+  double weight;
+  l_int32 components;
+  l_int32 classes;
+  double substitution_rate;	/* Of the sample's components */
+  double projected_classes;	/* For the whole book */
+};
+
+/* The grid of settings --auto-tune tries */
+static const double tune_thresholds[] = { 0.75, 0.80, 0.85, 0.90, 0.95 };
+static const double tune_weights[] = { 0.4, 0.5, 0.6, 0.7 };
+
+/* The settings are shared out between the threads as they finish them */
+struct tune_job
+{
+  PIX **sample;
+  int num_sample;
+  int num_pages;		/* Of the whole book */
+
+  struct tune_setting *settings;
+  int num_settings;
+
+  pthread_mutex_t lock;
+  int next_setting;
+};
+
+/*
+  Fit Heaps' law, classes = k * components^beta, to the growth of the
+  class count over the sample pages, by least squares on the logs.
+*/
+static void
+fit_heaps_law (const l_int32 * components, const l_int32 * classes, int n,
+	       double *k, double *beta)
+{
+  int i;
+  int m = 0;
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      if (components[i] <= 0 || classes[i] <= 0)
+	continue;
+
+      double x = log (components[i]);
+      double y = log (classes[i]);
+
+      sx += x;
+      sy += y;
+      sxx += x * x;
+      sxy += x * y;
+      m++;
+    }
+
+  /* Not enough to fit, so assume every component is a new class */
+  if (m < 2 || m * sxx - sx * sx < 1e-9)
+    {
+      *beta = 1.0;
+      *k = n > 0 && components[n - 1] > 0 ?
+	(double) classes[n - 1] / components[n - 1] : 1.0;
+      return;
+    }
+
+  *beta = (m * sxy - sx * sy) / (m * sxx - sx * sx);
+  if (*beta < 0)
+    *beta = 0;
+  if (*beta > 1)
+    *beta = 1;
+  *k = exp ((sy - *beta * sx) / m);
+}
+
+static void
+tune_one_setting (struct tune_job *job, struct tune_setting *setting)
+{
+  int i;
+  l_int32 *sumtab = makePixelSumTab8 ();
+  l_int32 *components = malloc_guarded (job->num_sample * sizeof (l_int32));
+  l_int32 *classes = malloc_guarded (job->num_sample * sizeof (l_int32));
+  struct timespec start;
+  stats_start (&start);
+
+  JBCLASSER *classer =
+    jbCorrelationInitWithoutComponents (JB_CONN_COMPS, 9999, 9999,
+					setting->thresh, setting->weight);
+
+  if (classer == NULL)
+    {
+      error_quit ("Unable to create leptonica JBCLASSER.");
+    }
+
+  for (i = 0; i < job->num_sample; i++)
+    {
+      /* Every thread classifies its own copy, leptonica may clone it */
+      PIX *page = pixCopy (NULL, job->sample[i]);
+
+      if (jbAddPage (classer, page) == 1)
+	{
+	  error_quit ("Unable to add page to JBCLASSIFIER.");
+	}
+
+      components[i] = numaGetCount (classer->naclass);
+      classes[i] = classer->nclass;
+      pixDestroy (&page);
+    }
+
+  /* The sample's templates are small, so they never spill */
+  struct template_store *store;
+  JBDATA *data = save_classes (classer, 0, &store);
+
+  jbClasserDestroy (&classer);
+
+  /* Substitutions are components far from their template */
+  PIXA *templates = extract_templates (store);
+  l_int32 ncomp = numaGetCount (data->naclass);
+  l_int32 comp = 0;
+  long num_substitutions = 0;
+
+  for (i = 0; i < job->num_sample; i++)
+    {
+      for (; comp < components[i]; comp++)
+	{
+	  if (component_error (data, templates, job->sample[i], comp, sumtab)
+	      > VERIFY_DEFAULT_THRESHOLD)
+	    num_substitutions++;
+	}
+    }
+
+  setting->components = ncomp;
+  setting->classes = data->nclass;
+  setting->substitution_rate = ncomp > 0 ?
+    (double) num_substitutions / ncomp : 0.0;
+
+  /* Extrapolate the class count to the components of the whole book */
+  double k, beta;
+  fit_heaps_law (components, classes, job->num_sample, &k, &beta);
+
+  double book_components = (double) ncomp / job->num_sample * job->num_pages;
+  setting->projected_classes = k * pow (book_components, beta);
+  if (setting->projected_classes < setting->classes)
+    setting->projected_classes = setting->classes;
+
+  pixaDestroy (&templates);
+  destroy_template_store (store);
+  jbDataDestroy (&data);
+  free (classes);
+  free (components);
+  free (sumtab);
+
+  stats_stop (STAGE_TUNE, &start, -1);
+}
+
+static void *
+tune_settings (void *arg)
+{
+  struct tune_job *job = arg;
+
+  while (1)
+    {
+      pthread_mutex_lock (&job->lock);
+      int setting = job->next_setting++;
+      pthread_mutex_unlock (&job->lock);
+
+      if (setting >= job->num_settings)
+	break;
+
+      tune_one_setting (job, &job->settings[setting]);
+    }
+
+  return NULL;
+}
+
+void
+auto_tune (const struct page_source *pages, int num_threads, double target,
+	   double *thresh, double *weight)
+{
+  int i, j;
+  int num_thresholds = sizeof (tune_thresholds) / sizeof (tune_thresholds[0]);
+  int num_weights = sizeof (tune_weights) / sizeof (tune_weights[0]);
+  struct tune_job job;
+
+  /* Pages spread evenly through the book */
+  job.num_pages = pages->num_pages;
+  job.num_sample = pages->num_pages < TUNE_SAMPLE_PAGES ?
+    pages->num_pages : TUNE_SAMPLE_PAGES;
+  job.sample = malloc_guarded (job.num_sample * sizeof (PIX *));
+
+  for (i = 0; i < job.num_sample; i++)
+    {
+      int page = (int) ((long) pages->num_pages * i / job.num_sample);
+
+      job.sample[i] = read_page_text (pages, page, NULL, pages->num_threads);
+
+      if (job.sample[i] == NULL || pixGetDepth (job.sample[i]) != 1)
+	{
+	  printf ("Problem with page ");
+	  print_page_name (pages, page);
+	  printf ("\n");
+	  error_quit ("Unable to read page for --auto-tune.");
 	}
+    }
 
-      if (pixGetDepth (page) != 1)
+  job.num_settings = num_thresholds * num_weights;
+  job.settings = malloc_guarded (job.num_settings *
+				 sizeof (struct tune_setting));
+
+  for (i = 0; i < num_thresholds; i++)
+    {
+      for (j = 0; j < num_weights; j++)
 	{
-	  printf ("Input file %s is not 1bpp\n", input_files[i]);
-	  error_quit
-	    ("Only 1bpp (black and white) images currently supported.");
+	  job.settings[i * num_weights + j].thresh = tune_thresholds[i];
+	  job.settings[i * num_weights + j].weight = tune_weights[j];
 	}
+    }
 
-      if (jbAddPage (classer, page) == 1)
+  if (num_threads > job.num_settings)
+    num_threads = job.num_settings;
+
+  pthread_t *threads = malloc_guarded (num_threads * sizeof (pthread_t));
+
+  pthread_mutex_init (&job.lock, NULL);
+  job.next_setting = 0;
+
+  for (i = 0; i < num_threads; i++)
+    {
+      if (pthread_create (&threads[i], NULL, tune_settings, &job) != 0)
 	{
-	  printf ("Problem with page %s\n", input_files[i]);
-	  error_quit ("Unable to add page to JBCLASSIFIER.");
+	  error_quit ("Unable to create auto-tune thread.");
 	}
+    }
 
-      pixDestroy (&page);
+  for (i = 0; i < num_threads; i++)
+    {
+      pthread_join (threads[i], NULL);
     }
 
-  /* This is the part we have to add stuff to save each glyph separately */
-  JBDATA *data = jbDataSave (classer);
+  /*
+     The font stage dominates the run time, and it takes time in
+     proportion to the number of classes. So the cheapest setting that
+     meets the target is the one with the fewest projected classes, or
+     if none do, the one with the fewest substitutions.
+   */
+  int best = -1;
 
-  if (data == NULL)
+  printf ("Auto-tune on %d sample pages:\n", job.num_sample);
+  printf ("  thresh  weight  classes  substitutions  projected classes\n");
+
+  for (i = 0; i < job.num_settings; i++)
     {
-      error_quit ("Unable to create the leptonica JBDATA.");
-    }
+      const struct tune_setting *setting = &job.settings[i];
 
-  jbClasserDestroy (&classer);
+      printf ("  %6.2f  %6.2f  %7d  %12.3f%%  %17.0f\n", setting->thresh,
+	      setting->weight, setting->classes,
+	      100 * setting->substitution_rate, setting->projected_classes);
 
-  return data;
-}
+      if (setting->substitution_rate > target)
+	continue;
 
-int
-register_mappings (const JBDATA * data, struct mapping **in_maps)
-{
-  int i;
-  /* Register mappings for each component */
-  l_int32 ncomp = numaGetCount (data->naclass);
+      if (best == -1
+	  || setting->projected_classes < job.settings[best].projected_classes)
+	best = i;
+    }
 
-  *in_maps = malloc_guarded (ncomp * sizeof (struct mapping));
-  struct mapping *maps = *in_maps;
-  for (i = 0; i < ncomp; i++)
+  if (best == -1)
     {
-      maps[i].used = 0;
+      printf ("No setting meets the target of %.3f%% substitutions.\n",
+	      100 * target);
+
+      best = 0;
+      for (i = 1; i < job.num_settings; i++)
+	{
+	  if (job.settings[i].substitution_rate <
+	      job.settings[best].substitution_rate)
+	    best = i;
+	}
     }
 
-  unsigned char code_point = first_code_point ();
-  int font_num = 0;
+  *thresh = job.settings[best].thresh;
+  *weight = job.settings[best].weight;
 
-  for (i = 0; i < data->nclass; i++)
+  printf ("Using thresh %.2f and weight %.2f, about %.0f classes\n",
+	  *thresh, *weight, job.settings[best].projected_classes);
+
+  for (i = 0; i < job.num_sample; i++)
     {
-      l_int32 iclass = i;
+      pixDestroy (&job.sample[i]);
+    }
 
-      if (maps[iclass].used)
-	continue;
+  pthread_mutex_destroy (&job.lock);
+  free (threads);
+  free (job.settings);
+  free (job.sample);
+}
 
-      maps[iclass].iclass = iclass;
-      maps[iclass].font_num = font_num;
-      maps[iclass].code_point = code_point;
-      maps[iclass].used = 1;
+/* A finished stage, for the trace */
+struct stats_event
+{
+  int stage;
+  int index;
+  int tid;
+  double start;			/* Seconds since stats_init */
+  double seconds;
+};
+
+static struct
+{
+  int enabled;
+  int trace;
+  struct timespec origin;
+  pthread_mutex_t lock;
+  int next_tid;
+
+  double seconds[NUM_STATS_STAGES];
+  long calls[NUM_STATS_STAGES];
+  long end_rss_kb[NUM_STATS_STAGES];	/* Largest RSS a call ended with */
+  long counters[NUM_STATS_COUNTERS];
+
+  int num_pages;
+  long *page_components;
+  long *page_classes;
+
+  int num_events;
+  int events_capacity;
+  struct stats_event *events;
+} stats = { 0, 0, {0, 0}, PTHREAD_MUTEX_INITIALIZER };
+
+/* Small thread numbers for the trace, 0 until a thread stops a stage */
+static __thread int stats_tid = 0;
+
+static const char *stats_stage_names[NUM_STATS_STAGES] = {
+  "decode", "binarize", "segment", "classify", "jbdata_save", "dict",
+  "tune", "consolidate", "ocr", "mapping", "templates", "font", "pdf_build",
+  "pdf_save", "html", "verify"
+};
+
+static const char *stats_counter_names[NUM_STATS_COUNTERS] = {
+  "pages", "components", "classes", "classes_merged", "dict_comparisons",
+  "dict_matches", "ocr_recognized", "pictures", "fonts", "glyphs_traced",
+  "glyphs_reused", "font_bytes", "font_bytes_saved", "output_bytes",
+  "substitutions"
+};
+
+static double
+seconds_between (const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) +
+    (end->tv_nsec - start->tv_nsec) / 1e9;
+}
 
-      if (code_point == max_code_point ())
+/*
+  The resident set size now, in kilobytes, or 0 without /proc.
+  getrusage only has the peak of the whole run so far, which never
+  comes down after the biggest stage.
+*/
+static long
+current_rss_kb ()
+{
+  long size, resident = 0;
+  FILE *f = fopen ("/proc/self/statm", "r");
+
+  if (f == NULL)
+    return 0;
+
+  if (fscanf (f, "%ld %ld", &size, &resident) != 2)
+    resident = 0;
+  fclose (f);
+
+  return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+void
+stats_init (int enabled, int trace)
+{
+  stats.enabled = enabled;
+  stats.trace = trace;
+  clock_gettime (CLOCK_MONOTONIC, &stats.origin);
+}
+
+void
+stats_start (struct timespec *start)
+{
+  if (stats.enabled)
+    clock_gettime (CLOCK_MONOTONIC, start);
+}
+
+void
+stats_stop (int stage, const struct timespec *start, int index)
+{
+  if (!stats.enabled)
+    return;
+
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  long rss_kb = current_rss_kb ();
+
+  pthread_mutex_lock (&stats.lock);
+
+  stats.seconds[stage] += seconds_between (start, &now);
+  stats.calls[stage]++;
+  if (rss_kb > stats.end_rss_kb[stage])
+    stats.end_rss_kb[stage] = rss_kb;
+
+  if (stats.trace)
+    {
+      if (stats_tid == 0)
+	stats_tid = ++stats.next_tid;
+
+      if (stats.num_events == stats.events_capacity)
 	{
-	  code_point = first_code_point ();
-	  font_num++;
+	  stats.events_capacity = 2 * stats.events_capacity + 64;
+	  stats.events = realloc_guarded (stats.events,
+					  stats.events_capacity *
+					  sizeof (struct stats_event));
 	}
-      else
+
+      struct stats_event *event = &stats.events[stats.num_events++];
+      event->stage = stage;
+      event->index = index;
+      event->tid = stats_tid;
+      event->start = seconds_between (&stats.origin, start);
+      event->seconds = seconds_between (start, &now);
+    }
+
+  pthread_mutex_unlock (&stats.lock);
+}
+
+void
+stats_count (int counter, long n)
+{
+  if (!stats.enabled)
+    return;
+
+  pthread_mutex_lock (&stats.lock);
+  stats.counters[counter] += n;
+  pthread_mutex_unlock (&stats.lock);
+}
+
+void
+stats_page (int page, long components, long classes)
+{
+  if (!stats.enabled)
+    return;
+
+  pthread_mutex_lock (&stats.lock);
+
+  if (page >= stats.num_pages)
+    {
+      stats.page_components =
+	realloc_guarded (stats.page_components, (page + 1) * sizeof (long));
+      stats.page_classes =
+	realloc_guarded (stats.page_classes, (page + 1) * sizeof (long));
+
+      for (; stats.num_pages <= page; stats.num_pages++)
 	{
-	  code_point = next_code_point (code_point);
+	  stats.page_components[stats.num_pages] = 0;
+	  stats.page_classes[stats.num_pages] = 0;
 	}
     }
-  printf ("%d fonts\n", font_num + 1);
 
-  return font_num + 1;
+  stats.page_components[page] = components;
+  stats.page_classes[page] = classes;
+  stats.counters[COUNTER_PAGES]++;
+  stats.counters[COUNTER_COMPONENTS] += components;
+
+  pthread_mutex_unlock (&stats.lock);
+}
+
+void
+write_stats (const char *filename)
+{
+  int i;
+  struct timespec now;
+  struct rusage self;
+  struct rusage children;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  getrusage (RUSAGE_SELF, &self);
+  /* The font generators, after they have been waited for */
+  getrusage (RUSAGE_CHILDREN, &children);
+
+  FILE *out = fopen (filename, "w");
+
+  if (out == NULL)
+    {
+      printf ("Failed to open %s.\n", filename);
+      error_quit ("Could not write stats.");
+    }
+
+  fprintf (out, "{\n");
+  fprintf (out, "  \"version\": \"%s\",\n", SMOOTHSCAN_VERSION);
+  fprintf (out, "  \"wall_seconds\": %.6f,\n",
+	   seconds_between (&stats.origin, &now));
+  fprintf (out, "  \"peak_rss_kb\": %ld,\n", (long) self.ru_maxrss);
+  fprintf (out, "  \"children_peak_rss_kb\": %ld,\n",
+	   (long) children.ru_maxrss);
+
+  fprintf (out, "  \"stages\": {\n");
+  for (i = 0; i < NUM_STATS_STAGES; i++)
+    {
+      fprintf (out, "    \"%s\": {\"seconds\": %.6f, \"calls\": %ld, "
+	       "\"end_rss_kb\": %ld}%s\n", stats_stage_names[i],
+	       stats.seconds[i], stats.calls[i], stats.end_rss_kb[i],
+	       i + 1 < NUM_STATS_STAGES ? "," : "");
+    }
+  fprintf (out, "  },\n");
+
+  fprintf (out, "  \"counters\": {\n");
+  for (i = 0; i < NUM_STATS_COUNTERS; i++)
+    {
+      fprintf (out, "    \"%s\": %ld%s\n", stats_counter_names[i],
+	       stats.counters[i], i + 1 < NUM_STATS_COUNTERS ? "," : "");
+    }
+  fprintf (out, "  },\n");
+
+  fprintf (out, "  \"pages\": [\n");
+  for (i = 0; i < stats.num_pages; i++)
+    {
+      fprintf (out, "    {\"components\": %ld, \"classes\": %ld}%s\n",
+	       stats.page_components[i], stats.page_classes[i],
+	       i + 1 < stats.num_pages ? "," : "");
+    }
+  fprintf (out, "  ]\n");
+  fprintf (out, "}\n");
+
+  if (fclose (out) != 0)
+    {
+      error_quit ("Could not write stats.");
+    }
+}
+
+void
+write_trace (const char *filename)
+{
+  int i;
+  FILE *out = fopen (filename, "w");
+
+  if (out == NULL)
+    {
+      printf ("Failed to open %s.\n", filename);
+      error_quit ("Could not write trace.");
+    }
+
+  /* Complete ("X") events, times are in microseconds */
+  fprintf (out, "{\"traceEvents\": [\n");
+  for (i = 0; i < stats.num_events; i++)
+    {
+      const struct stats_event *event = &stats.events[i];
+
+      fprintf (out, "{\"name\": \"%s\", \"cat\": \"smoothscan\", "
+	       "\"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+	       "\"ts\": %.1f, \"dur\": %.1f",
+	       stats_stage_names[event->stage], (int) getpid (), event->tid,
+	       event->start * 1e6, event->seconds * 1e6);
+
+      if (event->index >= 0)
+	fprintf (out, ", \"args\": {\"index\": %d}", event->index);
+
+      fprintf (out, "}%s\n", i + 1 < stats.num_events ? "," : "");
+    }
+  fprintf (out, "]}\n");
+
+  if (fclose (out) != 0)
+    {
+      error_quit ("Could not write trace.");
+    }
+}
+
+/*
+  standard is what smoothscan always did. draft skips the curve
+  fitting, simplification and hinting, and merges more symbols into
+  each class, so there are fewer glyphs to make. archival fits the
+  curves closer and keeps the pictures sharper.
+*/
+static const struct profile profiles[] = {
+  {"draft", "pixels", 1.0, 0.2, 0, 1, 0, 50, 0.80, 0.6},
+  {"standard", "potrace", 1.0, 0.2, 0, 1, 1, 75, 0.85, 0.5},
+  {"archival", "potrace", 1.0, 0.05, 0, 1, 1, 92, 0.90, 0.5},
+};
+
+void
+apply_profile (struct args *args)
+{
+  const struct profile *profile = NULL;
+  int i;
+
+  /* Tuning would throw away the settings given for thresh and weight */
+  if (args->auto_tune
+      && (args->thresh >= 0 || args->weight >= 0 || args->profile != NULL))
+    {
+      error_quit ("--auto-tune picks the threshold and weight itself, so it "
+		  "can't be used with -t, -w or --profile.");
+    }
+
+  if (args->profile == NULL)
+    args->profile = "standard";
+
+  for (i = 0; i < (int) (sizeof (profiles) / sizeof (profiles[0])); i++)
+    {
+      if (strcmp (profiles[i].name, args->profile) == 0)
+	profile = &profiles[i];
+    }
+
+  if (profile == NULL)
+    {
+      error_quit ("Profile must be draft, standard or archival.");
+    }
+
+  /* Only measure the outline optimization the user asked for */
+  args->measure_outlines = args->outline_tolerance >= 0
+    || args->outline_grid > 0 || args->no_hinting == 1;
+
+  if (args->tracer == NULL)
+    args->tracer = (char *) profile->tracer;
+  args->alphamax = profile->alphamax;
+  args->opttolerance = profile->opttolerance;
+  if (args->outline_tolerance < 0)
+    args->outline_tolerance = profile->outline_tolerance;
+  if (args->outline_grid <= 0)
+    args->outline_grid = profile->outline_grid;
+  if (args->no_hinting < 0)
+    args->no_hinting = !profile->hinting;
+  args->jpeg_quality = profile->jpeg_quality;
+  if (args->thresh < 0)
+    args->thresh = profile->thresh;
+  if (args->weight < 0)
+    args->weight = profile->weight;
 }
 
 struct args *
@@ -624,8 +5316,30 @@ parse_args (int argc, char *argv[])
   args->num_input_files = 0;
   args->input_files = NULL;
   args->outname = NULL;
-  args->thresh = .85;
-  args->weight = .5;
+  /* -1 and NULL are left for apply_profile to fill in */
+  args->thresh = -1;
+  args->weight = -1;
+  args->dict_dir = NULL;
+  args->consolidate = 0;
+  args->template_memory = (size_t) TEMPLATE_MEMORY_DEFAULT << 20;
+  args->auto_tune = 0;
+  args->tune_target = TUNE_DEFAULT_TARGET;
+  args->binarize = BINARIZE_SAUVOLA;
+  args->mixed = 0;
+  args->ocr_lang = NULL;
+  args->format = OUTPUT_PDF;
+  args->outline_tolerance = -1;
+  args->outline_grid = 0;
+  args->no_hinting = -1;
+  args->profile = NULL;		/* standard, unless given */
+  args->tracer = NULL;
+  args->linearize = 0;
+  args->update_file = NULL;
+  args->replace_page = 0;
+  args->volume_pages = 0;
+  args->threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (args->threads < 1)
+    args->threads = 1;
 
   args->help_flag = 0;
   args->version_flag = 0;
@@ -636,6 +5350,11 @@ parse_args (int argc, char *argv[])
   args->debug_skip_font_gen = 0;
   args->debug_no_clean_tmpdir = 0;
 
+  args->stats_file = NULL;
+  args->trace_file = NULL;
+  args->verify_dir = NULL;
+  args->verify_threshold = VERIFY_DEFAULT_THRESHOLD;
+
   /* Process Command Line args */
   int c;
 
@@ -645,6 +5364,30 @@ parse_args (int argc, char *argv[])
     {"version", no_argument, &args->version_flag, 1},
     {"thresh", required_argument, 0, 't'},
     {"weight", required_argument, 0, 'w'},
+    {"dict", required_argument, 0, 'd'},
+    {"consolidate", required_argument, 0, 0},
+    {"template-memory", required_argument, 0, 0},
+    {"auto-tune", no_argument, &args->auto_tune, 1},
+    {"tune-target", required_argument, 0, 0},
+    {"binarize", required_argument, 0, 0},
+    {"threads", required_argument, 0, 'j'},
+    {"mixed", no_argument, &args->mixed, 1},
+    {"ocr", required_argument, 0, 0},
+    {"format", required_argument, 0, 0},
+    {"outline-tolerance", required_argument, 0, 0},
+    {"outline-grid", required_argument, 0, 0},
+    {"no-hinting", no_argument, &args->no_hinting, 1},
+    {"hinting", no_argument, &args->no_hinting, 0},
+    {"profile", required_argument, 0, 0},
+    {"tracer", required_argument, 0, 0},
+    {"linearize", no_argument, &args->linearize, 1},
+    {"update", required_argument, 0, 0},
+    {"replace", required_argument, 0, 0},
+    {"volume-pages", required_argument, 0, 0},
+    {"stats", required_argument, 0, 0},
+    {"trace", required_argument, 0, 0},
+    {"verify", required_argument, 0, 0},
+    {"verify-threshold", required_argument, 0, 0},
 
     /* Debug options */
     {"debug-tmpdir", required_argument, 0, 0},
@@ -659,7 +5402,7 @@ parse_args (int argc, char *argv[])
     {
       int option_index = 0;
 
-      c = getopt_long (argc, argv, "hvo:t:w:", long_options, &option_index);
+      c = getopt_long (argc, argv, "hvo:t:w:d:j:", long_options, &option_index);
 
       if (c == -1)
 	break;
@@ -672,6 +5415,105 @@ parse_args (int argc, char *argv[])
 	      {
 		args->debug_tmpdir = optarg;
 	      }
+	    else if (strcmp ("binarize", long_options[option_index].name) ==
+		     0)
+	      {
+		if (strcmp (optarg, "none") == 0)
+		  args->binarize = BINARIZE_NONE;
+		else if (strcmp (optarg, "otsu") == 0)
+		  args->binarize = BINARIZE_OTSU;
+		else if (strcmp (optarg, "sauvola") == 0)
+		  args->binarize = BINARIZE_SAUVOLA;
+		else
+		  error_quit ("Binarization must be none, otsu or sauvola.");
+	      }
+	    else if (strcmp ("format", long_options[option_index].name) == 0)
+	      {
+		if (strcmp (optarg, "pdf") == 0)
+		  args->format = OUTPUT_PDF;
+		else if (strcmp (optarg, "html") == 0)
+		  args->format = OUTPUT_HTML;
+		else
+		  error_quit ("Output format must be pdf or html.");
+	      }
+	    else if (strcmp ("outline-tolerance",
+			     long_options[option_index].name) == 0)
+	      {
+		sscanf (optarg, "%lf", &args->outline_tolerance);
+	      }
+	    else if (strcmp ("outline-grid",
+			     long_options[option_index].name) == 0)
+	      {
+		sscanf (optarg, "%d", &args->outline_grid);
+	      }
+	    else if (strcmp ("consolidate",
+			     long_options[option_index].name) == 0)
+	      {
+		sscanf (optarg, "%lf", &args->consolidate);
+	      }
+	    else if (strcmp ("template-memory",
+			     long_options[option_index].name) == 0)
+	      {
+		int megabytes = 0;
+		sscanf (optarg, "%d", &megabytes);
+		if (megabytes < 0)
+		  error_quit ("Template memory can't be negative.");
+		args->template_memory = (size_t) megabytes << 20;
+	      }
+	    else if (strcmp ("tune-target",
+			     long_options[option_index].name) == 0)
+	      {
+		double percent;
+		sscanf (optarg, "%lf", &percent);
+		args->tune_target = percent / 100;
+	      }
+	    else if (strcmp ("profile", long_options[option_index].name) == 0)
+	      {
+		args->profile = optarg;
+	      }
+	    else if (strcmp ("tracer", long_options[option_index].name) == 0)
+	      {
+		if (strcmp (optarg, "potrace") != 0
+		    && strcmp (optarg, "pixels") != 0)
+		  error_quit ("Tracer must be potrace or pixels.");
+		args->tracer = optarg;
+	      }
+	    else if (strcmp ("update", long_options[option_index].name) == 0)
+	      {
+		args->update_file = optarg;
+	      }
+	    else if (strcmp ("replace", long_options[option_index].name) == 0)
+	      {
+		sscanf (optarg, "%d", &args->replace_page);
+		if (args->replace_page < 1)
+		  error_quit ("--replace pages are numbered from 1.");
+	      }
+	    else if (strcmp ("volume-pages",
+			     long_options[option_index].name) == 0)
+	      {
+		sscanf (optarg, "%d", &args->volume_pages);
+	      }
+	    else if (strcmp ("ocr", long_options[option_index].name) == 0)
+	      {
+		args->ocr_lang = optarg;
+	      }
+	    else if (strcmp ("stats", long_options[option_index].name) == 0)
+	      {
+		args->stats_file = optarg;
+	      }
+	    else if (strcmp ("trace", long_options[option_index].name) == 0)
+	      {
+		args->trace_file = optarg;
+	      }
+	    else if (strcmp ("verify", long_options[option_index].name) == 0)
+	      {
+		args->verify_dir = optarg;
+	      }
+	    else if (strcmp ("verify-threshold",
+			     long_options[option_index].name) == 0)
+	      {
+		sscanf (optarg, "%lf", &args->verify_threshold);
+	      }
 	    break;
 	  }
 	case 'o':
@@ -694,6 +5536,16 @@ parse_args (int argc, char *argv[])
 	    args->weight = value;
 	    break;
 	  }
+	case 'd':
+	  {
+	    args->dict_dir = optarg;
+	    break;
+	  }
+	case 'j':
+	  {
+	    sscanf (optarg, "%d", &args->threads);
+	    break;
+	  }
         case 'h':
           {
             args->help_flag = 1;
@@ -745,6 +5597,8 @@ parse_args (int argc, char *argv[])
       error_quit ("No input files specified.");
     }
 
+  apply_profile (args);
+
   return args;
 }
 
@@ -756,19 +5610,49 @@ validate_args (const struct args *args)
     {
       error_quit ("No input files specified.");
     }
-  if (args->outname == NULL)
+  if (args->outname == NULL && args->update_file == NULL)
     {
       error_quit ("No output file specified.");
     }
-  /* Check that all input files exist */
+  if (args->update_file != NULL)
+    {
+      if (args->outname != NULL)
+	error_quit ("--update changes the book in place, so it takes no -o.");
+      if (args->dict_dir == NULL)
+	error_quit ("--update needs the --dict the book was made with.");
+      if (args->format != OUTPUT_PDF || args->linearize
+	  || args->volume_pages > 0)
+	error_quit ("--update only works on plain pdf output.");
+      if (!file_exists (args->update_file))
+	error_quit ("The book to --update doesn't exist.");
+    }
+  else if (args->replace_page > 0)
+    {
+      error_quit ("--replace only works with --update.");
+    }
+  if (args->debug_skip_font_gen && args->debug_tmpdir == NULL)
+    {
+      error_quit ("--debug-skip-font-gen needs fonts from --debug-tmpdir.");
+    }
+  /* Check that all input files exist, and stdin is used at most once */
+  int num_stdin = 0;
   for (i = 0; i < args->num_input_files; i++)
     {
+      if (strcmp (args->input_files[i], "-") == 0)
+	{
+	  num_stdin++;
+	  continue;
+	}
       if (!file_exists (args->input_files[i]))
 	{
 	  printf ("Can't read %s.\n", args->input_files[i]);
 	  error_quit ("Input file doesn't exist.");
 	}
     }
+  if (num_stdin > 1)
+    {
+      error_quit ("stdin (-) can only be given as an input once.");
+    }
   /* 
      Check thresh and weight in valid range
      thresh (value for correlation score: in [0.4 - 0.98])
@@ -782,18 +5666,96 @@ validate_args (const struct args *args)
     {
       error_quit ("Weight must be in range [0.0 - 1.0]");
     }
-  /* Confirm overwriting if outname exists */
-  if (file_exists (args->outname))
+  if (args->tune_target < 0.0 || args->tune_target > 1.0)
+    {
+      error_quit ("Tune target must be in range [0 - 100] percent");
+    }
+  if (args->consolidate != 0
+      && (args->consolidate < 0.4 || args->consolidate > 0.98))
+    {
+      error_quit ("Consolidation threshold must be in the range "
+		  "[0.4 - 0.98]");
+    }
+  if (args->consolidate != 0 && !args->auto_tune
+      && args->consolidate < args->thresh)
+    {
+      error_quit ("Consolidation threshold must be at least the threshold.");
+    }
+  if (args->threads < 1)
     {
-      char c = 'n';
-      printf ("Output file %s already exists. Overwrite? (y/N) ",
-	      args->outname);
-      scanf ("%c", &c);
-      if (c != 'Y' && c != 'y')
+      error_quit ("Must use at least 1 thread.");
+    }
+  if (args->volume_pages < 0)
+    {
+      error_quit ("Volumes must have at least 1 page.");
+    }
+  if (args->format == OUTPUT_HTML
+      && (args->linearize || args->volume_pages > 0))
+    {
+      error_quit ("--linearize and --volume-pages only apply to pdf output.");
+    }
+  if (args->outline_tolerance < 0 || args->outline_tolerance > 100)
+    {
+      error_quit ("Outline tolerance must be in range [0 - 100]");
+    }
+  if (args->outline_grid < 1 || args->outline_grid > 50)
+    {
+      error_quit ("Outline grid must be in range [1 - 50]");
+    }
+  if (args->verify_threshold < 0.0 || args->verify_threshold > 1.0)
+    {
+      error_quit ("Verify threshold must be in range [0.0 - 1.0]");
+    }
+#ifndef HAVE_TESSERACT
+  if (args->ocr_lang != NULL)
+    {
+      error_quit ("smoothscan was built without Tesseract, so --ocr is not "
+		  "available.");
+    }
+#endif
+#ifndef HAVE_QPDF
+  if (args->linearize)
+    {
+      error_quit ("smoothscan was built without qpdf, so --linearize is not "
+		  "available.");
+    }
+#endif
+  /*
+     Confirm overwriting if outname exists. When splitting into volumes,
+     outname may never be written, and main confirms once it knows the
+     number of pages.
+   */
+  if (args->outname != NULL && args->volume_pages == 0)
+    {
+      confirm_overwrite (args, args->outname);
+    }
+
+  return 0;
+}
+
+void
+confirm_overwrite (const struct args *args, const char *filename)
+{
+  int i;
+
+  if (!file_exists (filename))
+    return;
+
+  /* The answer would be read from the input pages */
+  for (i = 0; i < args->num_input_files; i++)
+    {
+      if (strcmp (args->input_files[i], "-") == 0)
 	{
-	  error_quit ("Output file exists.");
+	  error_quit ("Output file exists, and can't ask to overwrite it "
+		      "when reading pages from stdin.");
 	}
     }
 
-  return 0;
+  char c = 'n';
+  printf ("Output file %s already exists. Overwrite? (y/N) ", filename);
+  scanf (" %c", &c);
+  if (c != 'Y' && c != 'y')
+    {
+      error_quit ("Output file exists.");
+    }
 }
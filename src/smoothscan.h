@@ -30,6 +30,231 @@ struct mapping
   int used;			/* 1 if used, 0 if empty */
 };
 
+/*
+  A glyph dictionary that persists between runs. Each entry is a
+  class template (clipped to its foreground), and the outline that was
+  traced from it, stored in pixels together with the offset of the
+  template in its lattice cell, so it can be reused by any document
+  regardless of its lattice size or where its templates sit.
+
+  On disk the dictionary is a directory holding templates.pa (a
+  leptonica PIXA of the templates) and one %08d.outline file per
+  entry, written by smoothscan-fontgen.py.
+*/
+struct glyph_dict
+{
+  char *dirname;
+  PIXA *templates;		/* The entry templates */
+  NUMA *naarea;			/* Foreground pixel count of each entry */
+  PTA *ptacent;			/* Centroid of each entry */
+  int num_loaded;		/* Entries that were on disk when loaded */
+};
+
+/* A generated font, kept in memory until it's in the output */
+struct font_buffer
+{
+  unsigned char *data;
+  size_t size;
+  char format[8];		/* "ttf", "woff2" or "woff" */
+  size_t full_size;		/* Size without outline optimization, or 0 */
+};
+
+/* How the font generator builds the fonts */
+struct font_options
+{
+  const char *format;		/* "ttf" for pdf, "woff2" for html */
+
+  /*
+     Outline size optimization, in 1/1000 em. Outlines are simplified
+     until they are off by up to tolerance, and their points are
+     snapped to a grid of grid units. 0 and 1 leave them as traced.
+   */
+  double tolerance;
+  int grid;
+  int hinting;			/* 1 to add TrueType hinting */
+  int first_font;		/* Fonts are named from SmoothScans<this> */
+  int measure;			/* 1 to report what the optimization saved */
+
+  const char *tracer;		/* "potrace", or "pixels" for drafts */
+  double alphamax;		/* potrace's corner threshold */
+  double opttolerance;		/* potrace's curve optimization tolerance */
+};
+
+/*
+  A quality/speed profile. It picks the settings that trade quality
+  against conversion time together, and options given on the command
+  line override them.
+*/
+struct profile
+{
+  const char *name;
+  const char *tracer;
+  double alphamax;
+  double opttolerance;
+  double outline_tolerance;
+  int outline_grid;
+  int hinting;
+  int jpeg_quality;		/* Of the picture regions, from 1 to 100 */
+  double thresh;
+  double weight;
+};
+
+/* What kind of document is written */
+enum output_format
+{
+  OUTPUT_PDF,
+  OUTPUT_HTML			/* A directory of web fonts and pages */
+};
+
+/* The most characters one class can stand for, for ligatures */
+#define OCR_MAX_CHARS 4
+
+/* OCR results below this confidence (0 - 100) are thrown away */
+#define OCR_MIN_CONFIDENCE 60
+
+/* The text OCR recognized a class template as */
+struct ocr_result
+{
+  int len;			/* 0 if it wasn't recognized */
+  l_uint32 chars[OCR_MAX_CHARS];	/* Unicode code points */
+};
+
+/* How pages that aren't 1bpp get binarized */
+enum binarize_method
+{
+  BINARIZE_NONE,		/* Don't, reject them */
+  BINARIZE_OTSU,		/* One global threshold per page */
+  BINARIZE_SAUVOLA		/* Local adaptive threshold */
+};
+
+/*
+  Sauvola binarization parameters. The threshold for each pixel is
+  m * (1 + k * (s / 128 - 1)), where m and s are the mean and standard
+  deviation over a (2 * SAUVOLA_HALF_WINDOW + 1) square window around
+  it.
+*/
+#define SAUVOLA_HALF_WINDOW 15
+#define SAUVOLA_K 0.35f
+
+/*
+  A picture (photo or halftone) region of a mixed page. These are kept
+  as compressed images and drawn under the text, instead of being
+  vectorized.
+*/
+struct picture
+{
+  int page;
+  l_int32 x;			/* Upper left corner on the page */
+  l_int32 y;
+  l_int32 w;
+  l_int32 h;
+  int format;			/* IFF_JFIF_JPEG or IFF_PNG */
+  l_uint8 *data;		/* The compressed image */
+  size_t size;
+};
+
+/* All the picture regions of the document, in page order */
+struct picture_list
+{
+  int jpeg_quality;
+  int n;
+  int capacity;
+  struct picture *pictures;
+};
+
+/*
+  The class templates, clipped to their foreground and packed one after
+  another, one bit per pixel with each row padded to a byte. Unlike the
+  lattice jbDataSave makes, which is the number of classes times the
+  size of the largest template (one figure or rule makes it huge), the
+  memory grows with the area of the templates. Once more than
+  memory_limit bytes are packed, everything goes to an unlinked
+  temporary file instead, which is memory-mapped when the store is
+  finished, so the kernel can page it in and out.
+*/
+struct template_entry
+{
+  l_int32 x;			/* Offset of the clipped template in its cell */
+  l_int32 y;
+  l_int32 w;
+  l_int32 h;
+  size_t offset;		/* Of its first row, in bytes */
+};
+
+struct template_store
+{
+  int n;
+  int capacity;
+  struct template_entry *entries;
+
+  size_t memory_limit;		/* 0 to always keep it in memory */
+  unsigned char *bits;		/* The packed rows, or the mapped file */
+  size_t size;
+  size_t bits_capacity;
+
+  int fd;			/* The spill file, or -1 */
+  int mapped;
+};
+
+/* Megabytes of templates kept in memory by default */
+#define TEMPLATE_MEMORY_DEFAULT 1024
+
+/*
+  The sum of every class's instances, pixel by pixel, in the frame of
+  the class template, for consolidate_classes. The averaged template
+  is black where at least half of the instances are.
+*/
+struct class_averages
+{
+  int n;
+  int capacity;
+  l_int32 *w;
+  l_int32 *h;
+  l_uint32 *count;		/* Instances added to each class */
+  l_uint32 **sums;
+};
+
+/*
+  Classes with fewer instances than this keep their own template: the
+  average of one or two instances is no cleaner than the template.
+*/
+#define CONSOLIDATE_MIN_INSTANCES 3
+
+/*
+  The input pages. A multi-page TIFF gives one page per image, every
+  other input file is a single page. Pages are numbered from 0 in the
+  order they were given, and only decoded when read_page asks for
+  them.
+*/
+struct page_source
+{
+  int binarize;			/* How read_page_text binarizes pages */
+  int num_threads;
+  int mixed;			/* 1 to split off picture regions */
+
+  int num_files;
+  char **input_files;
+  int *file_pages;		/* Number of pages in each file */
+  int *file_is_tiff;		/* 1 if the file is a TIFF */
+
+  /* If an input is "-", the contents of stdin */
+  l_uint8 *stdin_data;
+  size_t stdin_size;
+
+  int num_pages;
+  int *page_file;		/* Which file each page is in */
+  int *page_subpage;		/* The page's number inside its file */
+
+  /*
+     Where leptonica continues reading each TIFF page, found by reading
+     the page before it, so reading a TIFF in order doesn't walk its
+     directories from the start for every page. 0 if not known yet,
+     except for a file's first page.
+   */
+  size_t *page_offset;
+  pthread_mutex_t *offset_lock;
+};
+
 /* Hold the command line arguments for the program */
 struct args
 {
@@ -41,6 +266,29 @@ struct args
   /* Optional Parameters */
   double thresh;
   double weight;
+  char *dict_dir;
+  double consolidate;		/* Merge threshold, 0 not to */
+  size_t template_memory;	/* Bytes of templates kept in memory */
+  int auto_tune;
+  double tune_target;		/* Substitution rate --auto-tune accepts */
+  int binarize;
+  int threads;
+  int mixed;
+  char *ocr_lang;		/* --ocr, or NULL */
+  int format;			/* The output_format */
+  double outline_tolerance;
+  int outline_grid;
+  int no_hinting;		/* 0 for --hinting, -1 if neither was given */
+  char *profile;		/* NULL for the standard profile */
+  char *tracer;
+  double alphamax;
+  double opttolerance;
+  int jpeg_quality;
+  int measure_outlines;		/* 1 if the outline options were given */
+  int linearize;
+  char *update_file;		/* --update, or NULL */
+  int replace_page;		/* --replace, from 1, or 0 to append */
+  int volume_pages;		/* Pages per volume, 0 for one volume */
 
   /* Flags */
   int help_flag;
@@ -53,6 +301,58 @@ struct args
   int debug_render_pages;
   int debug_skip_font_gen;
   int debug_no_clean_tmpdir;
+
+  /* Instrumentation */
+  char *stats_file;		/* --stats, or NULL */
+  char *verify_dir;		/* --verify, or NULL */
+  double verify_threshold;
+  char *trace_file;		/* --trace, or NULL */
+};
+
+/*
+  The stages of a conversion that --stats times. Most run many times
+  (once per page or once per font), the report has their total.
+*/
+enum stats_stage
+{
+  STAGE_DECODE,			/* Decompress a page */
+  STAGE_BINARIZE,
+  STAGE_SEGMENT,		/* Find the picture regions (--mixed) */
+  STAGE_CLASSIFY,		/* jbAddPage */
+  STAGE_JBDATA_SAVE,		/* jbDataSave */
+  STAGE_DICT,			/* Match the glyph dictionary */
+  STAGE_TUNE,			/* Classify the sample with one setting */
+  STAGE_CONSOLIDATE,		/* Merge near duplicate classes */
+  STAGE_OCR,			/* One OCR thread's share of the classes */
+  STAGE_MAPPING,
+  STAGE_TEMPLATES,		/* Unpack all the templates */
+  STAGE_FONT,			/* One font generator job */
+  STAGE_PDF_BUILD,
+  STAGE_PDF_SAVE,
+  STAGE_HTML,
+  STAGE_VERIFY,			/* Render back and compare one page */
+  NUM_STATS_STAGES
+};
+
+/* The things --stats counts */
+enum stats_counter
+{
+  COUNTER_PAGES,
+  COUNTER_COMPONENTS,
+  COUNTER_CLASSES,
+  COUNTER_CLASSES_MERGED,	/* By --consolidate */
+  COUNTER_DICT_COMPARISONS,	/* Correlation scores against the dictionary */
+  COUNTER_DICT_MATCHES,
+  COUNTER_OCR_RECOGNIZED,	/* Classes OCR gave a character */
+  COUNTER_PICTURES,
+  COUNTER_FONTS,
+  COUNTER_GLYPHS_TRACED,
+  COUNTER_GLYPHS_REUSED,	/* Outlines reused from the dictionary */
+  COUNTER_FONT_BYTES,
+  COUNTER_FONT_BYTES_SAVED,	/* By outline optimization */
+  COUNTER_OUTPUT_BYTES,
+  COUNTER_SUBSTITUTIONS,	/* Components --verify flagged */
+  NUM_STATS_COUNTERS
 };
 
 /*
@@ -145,71 +445,403 @@ void *malloc_guarded (size_t size);
 int file_exists (const char *filename);
 
 /*
-  Create a font from the temp font directory with all the glyph image
-  in it. Currently this just invoke the python font generation. 
+  Same as malloc_guarded, but for realloc.
+*/
+void *realloc_guarded (void *ptr, size_t size);
 
-  dirname - The directory the font is stored in.
+/*
+  Create the temporary directory that debug files are written to.
+
+  dir - The directory to use. If NULL, then make_tmpdir will create a
+  new one in the directory stored in the environmental var TMPDIR, if
+  TMPDIR is empty it will use the value from POSIX's P_tmpdir, which
+  should be something like /tmp or /var/tmp depending on your system.
+*/
+char *make_tmpdir (char *dir);
 
-  fontname - The output filename for the font, including the .ttf
-  suffix
+/*
+  Start the python font generation (smoothscan-fontgen.py) for one
+  font. Nothing touches the disk: the glyphs to put in the font are
+  written to the generator's stdin, and the finished font is read back
+  from its stdout.
 
   latticeh, latticew - values from JBDATA
 
   fontnum - The internal number of the font (from the for loop).
- */
-void
-create_font_from_dir (const char *dirname, const char *fontname, int latticeh,
-		      int latticew, int fontnum);
+
+  options - What kind of font to generate. If it optimizes the
+  outlines, the generator also measures the font without optimization.
+
+  in - Output variable, the stream to write the glyph list to. Close
+  it when all the glyphs are written.
+
+  out_fd - Output variable, pass it to finish_font_generator.
+
+  Returns the generator's pid.
+*/
+pid_t
+start_font_generator (int latticeh, int latticew, int fontnum,
+		      const struct font_options *options, FILE ** in,
+		      int *out_fd);
+
+/*
+  Read the font back from a generator started with
+  start_font_generator, and wait for it to exit. The font data is
+  stored in font, and must be freed by the caller.
+*/
+void finish_font_generator (pid_t pid, int out_fd, struct font_buffer *font);
+
+/*
+  Read fonts 0 to num_fonts - 1 that an earlier run left in dirname.
+  Used by --debug-skip-font-gen.
+*/
+struct font_buffer *load_fonts_from_dir (const char *dirname, int num_fonts);
+
+/*
+  Load a TrueType font from memory into the pdf, embedding it. Returns
+  the font name to pass to HPDF_GetFont.
+*/
+const char *load_font_from_memory (HPDF_Doc pdf,
+				   const struct font_buffer *font);
+
+struct template_store *create_template_store (size_t memory_limit);
+
+/*
+  Clip template to its foreground and add it to the end of store.
+*/
+void template_store_add (struct template_store *store, PIX * template);
+
+/*
+  Call once every template is added, before reading any back.
+*/
+void finish_template_store (struct template_store *store);
+
+/*
+  Unpack template i. x and y, if not NULL, get its offset inside the
+  lattice cell. The caller must pixDestroy it.
+*/
+PIX *template_store_get (const struct template_store *store, int i,
+			 l_int32 * x, l_int32 * y);
+
+void destroy_template_store (struct template_store *store);
+
+/*
+  jbDataSave without the lattice image: data->pix is NULL, and the
+  templates go to a new template store in store instead.
+  latticew and latticeh are still the cell size the output places
+  glyphs by.
+*/
+JBDATA *save_classes (JBCLASSER * classer, size_t memory_limit,
+		      struct template_store **store);
+
+/*
+  Unpack every template. Entry i of the returned PIXA is the template
+  for class i, and its box holds the template's offset inside the
+  lattice cell. The caller must pixaDestroy it.
+*/
+PIXA *extract_templates (const struct template_store *store);
+
+/*
+  Return the filename of the outline stored for dictionary entry
+  entry. The caller must free it.
+*/
+char *dict_outline_name (const struct glyph_dict *dict, int entry);
+
+/*
+  Load the glyph dictionary from dirname, creating an empty one if the
+  directory doesn't exist yet.
+*/
+struct glyph_dict *load_glyph_dict (const char *dirname);
+
+/*
+  Write the dictionary's templates back to its directory. The
+  outlines of new entries are written by the font generator.
+*/
+void save_glyph_dict (const struct glyph_dict *dict);
+
+void destroy_glyph_dict (struct glyph_dict *dict);
+
+/*
+  Match every class template against the dictionary.
+
+  Returns an array of nclass entry numbers. An entry below
+  dict->num_loaded means the class matched a traced dictionary glyph
+  and can reuse its outline. Classes that matched nothing are appended
+  to the dictionary as new entries (numbered from num_loaded upwards),
+  and their outlines are saved when they get traced. The caller must
+  free the array.
+
+  thresh, weight - the same values given to the classifier. The
+  comparison uses the same weighted correlation score.
+*/
+int *match_dict_classes (struct glyph_dict *dict, PIXA * templates,
+			 double thresh, double weight);
+
+/*
+  Run OCR on each class template, so the cost of OCR grows with the
+  number of classes instead of the number of glyphs in the document.
+  Each template is recognized on its own, as a single character, by
+  Tesseract.
+
+  templates - The class templates, from extract_templates.
+
+  lang - The Tesseract language, like "eng".
+
+  num_threads - The templates are split between this many threads,
+  each with its own Tesseract instance.
+
+  Returns one result per class, which the caller must free. If
+  smoothscan was built without Tesseract, error_quits instead.
+*/
+struct ocr_result *recognize_classes (PIXA * templates, const char *lang,
+				      int num_threads);
+
+/*
+  Add a ToUnicode CMap to font, so the text of the pdf can be searched
+  and copied. Each code point of font font_num maps to the text OCR
+  recognized for its class, or to U+FFFD if OCR didn't recognize it.
+*/
+void add_to_unicode (HPDF_Doc pdf, HPDF_Font font, int font_num,
+		     const JBDATA * data, const struct mapping *maps,
+		     const struct ocr_result *ocr);
 
 /*
   Generate the fonts that will be embedded in the output pdf.
 
   data - The JBDATA from leptonica's classifier.
 
+  store - Its class templates.
+
   maps - Mapping each symbol to a font code point.
 
   num_fonts - The number of fonts to generate (calculated from the
   mapping phase)
 
-  dir - The alternate directory to store files in. If NULL, then
-  generate_fonts will use the value stored in the environmental var
-  TMPDIR, if TMPDIR is empty it will use the value from POSIX's
-  P_tmpdir, which should be something like /tmp or /var/tmp depending
-  on your system.
+  tmpdirname - If not NULL, the glyph images and generated fonts are
+  also written to this directory, for debugging.
+
+  dict - The glyph dictionary, or NULL if not using one.
+
+  dict_entries - The dictionary entry for each class, from
+  match_dict_classes. Ignored if dict is NULL.
+
+  options - The format and outline optimization of the fonts. If
+  fontforge can't write WOFF2 the fonts are WOFF instead, check each
+  font's format. If the outlines are optimized, the bytes saved are
+  reported for each font and overall.
+
+  Returns the num_fonts generated fonts.
  */
-char *generate_fonts (const JBDATA * data, const struct mapping *maps,
-		      int num_fonts, char *dir);
+struct font_buffer *generate_fonts (const JBDATA * data,
+				    const struct template_store *store,
+				    const struct mapping *maps, int num_fonts,
+				    const char *tmpdirname,
+				    const struct glyph_dict *dict,
+				    const int *dict_entries,
+				    const struct font_options *options);
 
 /*
   Create the pdf using libharu.
 
   outname - The filename to store the pdf into.
 
-  tmpdirname - The temp directory where all the fonts are stored.
+  font_data - The generated fonts.
 
   num_fonts - The number of fonts.
 
-  num_input_files - The number of input files (the number of pages in
-  the pdf)
+  first_page, num_pages - The input pages to put in the pdf. All of
+  them, unless the book is split into volumes.
 
   data - JBDATA from leptonica
   
   maps - mappings from each symbol to its font code point
 
+  ocr - The OCR result of each class, or NULL if OCR wasn't run. If
+  given, each font gets a ToUnicode CMap.
+
+  pictures - Picture regions to draw under the text, or NULL.
+
+  linearize - If 1, the pdf is linearized, see save_linearized.
+
   debug_draw_borders - if 1, draw red rectangles where each glyph
   should be placed, if 0 don't.
 
 */
 void
-generate_pdf (const char *outname, const char *tmpdirname, int num_fonts,
-	      int num_input_files, const JBDATA * data,
-	      const struct mapping *maps, int debug_draw_borders);
+generate_pdf (const char *outname, const struct font_buffer *font_data,
+	      int num_fonts, int first_page, int num_pages,
+	      const JBDATA * data, const struct mapping *maps,
+	      const struct ocr_result *ocr,
+	      const struct picture_list *pictures, int linearize,
+	      int debug_draw_borders);
+
+/*
+  Save pdf to outname linearized ("fast web view"), with qpdf: the
+  first page's objects and the hint tables come first, so viewers can
+  show the first page before the rest of the file has downloaded.
+  error_quits if smoothscan was built without qpdf.
+*/
+void save_linearized (HPDF_Doc pdf, const char *outname);
+
+/*
+  What an incremental update needs to know about the pdf it updates,
+  from its last trailer, catalog and page tree.
+*/
+struct pdf_info
+{
+  long startxref;		/* Offset of the last xref section */
+  long size;			/* The trailer's /Size */
+  long root;			/* Object number of the catalog */
+  long info;			/* Of the Info dictionary, or 0 */
+  char id[256];			/* The trailer's /ID array, or "" */
+  long pages;			/* Of the page tree */
+  int num_kids;			/* The pages, in order */
+  long *kids;
+};
+
+/*
+  Read the page tree of a pdf with xref tables (not streams) and a
+  flat page tree, like the ones smoothscan writes, following earlier
+  incremental updates. error_quits if it can't.
+*/
+struct pdf_info *read_pdf_info (const char *filename);
+
+void destroy_pdf_info (struct pdf_info *info);
+
+/*
+  Add num_pages new pages to book as a pdf incremental update, so only
+  the new objects are written. The pages are made by generate_pdf into
+  a temporary file, with their own fonts, and their objects are copied
+  to the end of book, renumbered, with a new page tree and an xref
+  section pointing back to the book's with /Prev. The num_pages
+  new pages take the place of the book's pages from first_page (from
+  0) on, the book's later pages are kept after them, and whatever runs
+  past the book's last page is appended. The replaced pages' objects stay in
+  the file, but nothing refers to them any more.
+*/
+void update_pdf (const char *bookname, const struct pdf_info *book,
+		 int first_page, const struct font_buffer *font_data,
+		 int num_fonts, int num_pages, const JBDATA * data,
+		 const struct mapping *maps, const struct ocr_result *ocr,
+		 const struct picture_list *pictures, int debug_draw_borders);
+
+/*
+  Return the file name of volume number volume (from 0) of a book
+  split into num_volumes volumes, like book-01.pdf for book.pdf. The
+  caller must free it.
+*/
+char *volume_name (const char *outname, int volume, int num_volumes);
+
+/*
+  Return the Unicode code point of KOI8-R code point c. The fonts are
+  KOI8-R encoded, so this is the character that shows a glyph.
+*/
+l_uint32 koi8r_to_unicode (unsigned char c);
+
+/*
+  Write the document as a directory that web browsers can read one page
+  at a time, instead of loading the whole book.
+
+  outdir is created if it doesn't exist, and gets:
+    index.html - A viewer that fetches the pages as they scroll into
+    view, so the first page shows up just as fast in a long book.
+    pages.json - The page index: the size and file of each page.
+    fonts.css - The @font-face rules for the fonts.
+    fonts/ - The fonts, as WOFF2 (or whatever font_data holds).
+    pages/ - One SVG fragment per page, placing each glyph with its
+    font, and the picture regions under them.
+    images/ - The picture regions of mixed pages.
+
+  The other arguments are the same as generate_pdf's.
+*/
+void generate_html (const char *outdir, const struct font_buffer *font_data,
+		    int num_fonts, int num_pages, const JBDATA * data,
+		    const struct mapping *maps,
+		    const struct picture_list *pictures);
+
+/*
+  Count the pages in input_files, without decoding them. An input file
+  named "-" is read from stdin.
+
+  binarize - The binarize_method for pages that aren't 1bpp.
+
+  num_threads - The number of threads to binarize each page with, when
+  pages are read one at a time.
+
+  mixed - If 1, pages are segmented into text and pictures, see
+  read_page_text.
+*/
+struct page_source *open_page_source (int num_input_files,
+				      char **input_files, int binarize,
+				      int num_threads, int mixed);
+
+/*
+  Decode page number page. Returns NULL if it can't be read. The
+  caller must pixDestroy it.
+*/
+PIX *read_page (const struct page_source *src, int page);
+
+/* Picture regions are compressed at jpeg_quality, from 1 to 100 */
+struct picture_list *create_picture_list (int jpeg_quality);
+
+void destroy_picture_list (struct picture_list *list);
+
+/*
+  Read the text of a page, to give to the classifier. Gray and color
+  pages are binarized with the source's binarize_method, unless it is
+  BINARIZE_NONE, in which case the page is returned as it is.
+
+  If the source is mixed, leptonica's morphological page segmentation
+  finds the halftone/photo regions. They are cleared from the returned
+  page, and added to pictures cut from the original page (if pictures
+  isn't NULL).
+
+  num_threads is the number of threads to binarize with: the source's
+  num_threads when reading one page at a time, 1 for callers that
+  already read a page per thread.
+*/
+PIX *read_page_text (const struct page_source *src, int page,
+		     struct picture_list *pictures, int num_threads);
+
+/*
+  Print the file name of page, and its page number inside the file if
+  it came from a multi-page TIFF. For error messages.
+*/
+void print_page_name (const struct page_source *src, int page);
+
+void destroy_page_source (struct page_source *src);
+
+/*
+  Return the Otsu threshold of the 256 bin gray histogram histo: the
+  gray value that best splits it into dark and light pixels.
+*/
+int otsu_threshold (NUMA * histo);
+
+/*
+  Binarize a gray or color page, returning a new 1bpp pix.
+
+  method - BINARIZE_OTSU or BINARIZE_SAUVOLA.
+
+  num_threads - Sauvola splits the page into this many bands of rows,
+  each binarized by its own thread.
+*/
+PIX *binarize_page (PIX * page, int method, int num_threads);
 
 /*
   Use leptonica to create the JBDATA, which is the dictionary of all
   the different symbols in the document.
 
-  input_files - The list of 1bpp images (1 image per page).
+  pages - The input pages. They are decoded (and binarized if needed)
+  one at a time as they are classified.
+
+  pictures - Picture regions of mixed pages are added to this list.
+  May be NULL if the pages aren't mixed.
+
+  averages - Every component is added to the average of its class, for
+  consolidate_classes. May be NULL.
+
+  template_memory, store - The class templates are put in a new
+  template store, which keeps up to template_memory bytes in memory.
   
   thresh - Specify the threshold value (value for correlation). Valid
   input is from [0.40 - 0.98]. Recommended values for scanned text
@@ -219,8 +851,40 @@ generate_pdf (const char *outname, const char *tmpdirname, int num_fonts,
   characters).  Valid input is from [0.0 - 1.0].  Recommended values
   for scanned text from [0.5 - 0.6].  Default is 0.5.
 */
-JBDATA *classify_components (int num_input_files, char **input_files,
-			     double thresh, double weight);
+JBDATA *classify_components (const struct page_source *pages,
+			     struct picture_list *pictures,
+			     struct class_averages *averages, double thresh,
+			     double weight, size_t template_memory,
+			     struct template_store **store);
+
+struct class_averages *create_class_averages ();
+
+void destroy_class_averages (struct class_averages *averages);
+
+/*
+  Add the instances of classer's components from first on, which are
+  all on page, to averages. New classes get their own sums.
+*/
+void add_to_class_averages (struct class_averages *averages,
+			    const JBCLASSER * classer, PIX * page,
+			    l_int32 first);
+
+/*
+  Noise and scan variance split one letter into several classes, that
+  each cost a glyph. This compares the averages of the classes'
+  instances, which are much cleaner than the first instance the
+  classifier keeps, and merges classes whose averages correlate by
+  thresh or more (raised by weight for thick symbols, like the
+  classifier does) into the most common one. naclass and ptaul of
+  data are rewritten to match. store is replaced by the templates of
+  the classes that are left, with the averages only for the classes
+  that took others in, so nothing changes where nothing merged.
+
+  Returns the number of classes removed.
+*/
+int consolidate_classes (JBDATA * data, struct template_store **store,
+			 const struct class_averages *averages, double thresh,
+			 double weight);
 
 
 /*
@@ -230,11 +894,110 @@ JBDATA *classify_components (int num_input_files, char **input_files,
 
   data - The leptonica JBDATA dictionary.
 
+  ocr - The OCR result of each class, or NULL. Classes recognized as a
+  single printable ASCII character get that character's code point, in
+  the first font where it is still free, so the fonts use real code
+  points where they can. Only the fonts the classes need anyway are
+  used for this; variants past them, and every other class, get the
+  next free code point.
+
   in_maps - This is actually an output variable, it will be modified
   to hold all the generate mappings. It will be allocated in
   register_mappings, so it's up to the caller to free it.
 */
-int register_mappings (const JBDATA * data, struct mapping **in_maps);
+int register_mappings (const JBDATA * data, const struct ocr_result *ocr,
+		       struct mapping **in_maps);
+
+/*
+  Instrumentation for --stats and --trace. Stages are timed by calling
+  stats_start and stats_stop around them, and things are counted with
+  stats_count. These are thread safe, and do nothing until stats_init
+  enables them.
+
+  trace - If 1, also keep every stage as an event for write_trace.
+*/
+void stats_init (int enabled, int trace);
+
+void stats_start (struct timespec *start);
+
+/*
+  Add the time since stats_start set start to stage, and note the peak
+  memory use so far.
+
+  index - The page or font the stage worked on, or -1. Only used in
+  the trace.
+*/
+void stats_stop (int stage, const struct timespec *start, int index);
+
+void stats_count (int counter, long n);
+
+/*
+  Record the number of components found on page, and the number of
+  classes after classifying it.
+*/
+void stats_page (int page, long components, long classes);
+
+/*
+  Write the stage times, peak memory, counters and per page numbers to
+  filename as JSON.
+*/
+void write_stats (const char *filename);
+
+/*
+  Write every timed stage to filename in the Chrome trace event format,
+  for chrome://tracing or Perfetto.
+*/
+void write_trace (const char *filename);
+
+/* Components whose template is off by more than this are flagged */
+#define VERIFY_DEFAULT_THRESHOLD 0.3
+
+/*
+  Check the output against the input, using num_threads threads. Each
+  page is read again, the templates placed on it are rendered at the
+  input resolution, and XORed with it. Components whose template is
+  off from what is under it by more than threshold, the fraction of
+  their black pixels that differ, are flagged as likely
+  substitutions. outdir gets verify.json, with the error of every
+  page and class and the flagged components, and a heatmap of each
+  page with flagged components or far more error than the rest.
+
+  Returns the number of heatmaps written.
+*/
+int verify_pages (const struct page_source *pages, const JBDATA * data,
+		  const struct template_store *store, const char *outdir,
+		  double threshold, int num_threads);
+
+/*
+  Draw the templates of components first to last - 1 on a blank w x h
+  page, where the output places them. The caller must pixDestroy it.
+*/
+PIX *render_templates (const JBDATA * data, PIXA * templates,
+		       l_int32 first, l_int32 last, l_int32 w, l_int32 h);
+
+/*
+  The first component of each page, and the number of components at
+  [num_pages]. The caller must free it.
+*/
+l_int32 *component_page_starts (const JBDATA * data, int num_pages);
+
+/* Pages --auto-tune classifies, spread through the book */
+#define TUNE_SAMPLE_PAGES 8
+/* The fraction of substituted components it accepts by default */
+#define TUNE_DEFAULT_TARGET 0.005
+
+/*
+  Pick thresh and weight for the book. A sample of the pages is
+  classified with every setting on a grid, using num_threads threads.
+  For each one, the substitution rate is the fraction of components
+  that verify_pages would flag, and the class count of the whole book
+  is projected from the sample with Heaps' law. Font generation time
+  grows with the class count, so the setting with the fewest
+  projected classes and a substitution rate up to target wins. If
+  none is good enough, the one with the fewest substitutions does.
+*/
+void auto_tune (const struct page_source *pages, int num_threads,
+		double target, double *thresh, double *weight);
 
 /*
   Create an arg struct with default parameters, and change them from
@@ -243,6 +1006,13 @@ int register_mappings (const JBDATA * data, struct mapping **in_maps);
 */
 struct args *parse_args (int argc, char *argv[]);
 
+/*
+  Fill in the settings args->profile decides, leaving the ones given
+  on the command line alone. error_quit if there is no such profile,
+  or if --auto-tune is asked to pick settings that were given.
+*/
+void apply_profile (struct args *args);
+
 /*
   Make sure all the command line arguments are valid.
 
@@ -250,4 +1020,11 @@ struct args *parse_args (int argc, char *argv[]);
 */
 int validate_args (const struct args *args);
 
+/*
+  If filename exists, ask whether to overwrite it, and error_quit
+  unless the answer is yes. Also error_quit if the pages are read from
+  stdin, where the answer would come from.
+*/
+void confirm_overwrite (const struct args *args, const char *filename);
+
 #endif /* SMOOTHSCAN_H_INCLUDED */
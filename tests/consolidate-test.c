@@ -0,0 +1,136 @@
+/*
+  This file is part of smoothscan.
+
+  smoothscan is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  smoothscan is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with smoothscan. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Check that --consolidate merges rare classes, with one and two
+  instances, into a common one, and that every glyph is still drawn
+  where it was on the page afterwards.
+*/
+
+/* The test has its own main */
+#define main smoothscan_main
+#include "../src/smoothscan.c"
+#undef main
+
+/* Glyphs are GLYPH pixels square, in the classifier's bordered frame */
+#define GLYPH 20
+#define FRAME (GLYPH + 2 * JB_ADDED_PIXELS)
+
+/* Class 0 is a square, 1 misses a corner pixel, 2 has one pixel more */
+static PIX *
+make_template (int iclass)
+{
+  PIX *pix = pixCreate (FRAME, FRAME, 1);
+
+  pixRasterop (pix, JB_ADDED_PIXELS, JB_ADDED_PIXELS, GLYPH, GLYPH, PIX_SET,
+	       NULL, 0, 0);
+
+  if (iclass == 1)
+    pixClearPixel (pix, JB_ADDED_PIXELS, JB_ADDED_PIXELS);
+  else if (iclass == 2)
+    pixSetPixel (pix, JB_ADDED_PIXELS + GLYPH, JB_ADDED_PIXELS + GLYPH / 2,
+		 1);
+
+  return pix;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i;
+  /* The class of each instance, left to right */
+  static const int instances[] = { 0, 0, 1, 0, 2, 0, 2, 0 };
+  int ncomp = sizeof (instances) / sizeof (instances[0]);
+  l_int32 w = ncomp * (FRAME + 8);
+  l_int32 h = FRAME + 8;
+  int failed = 0;
+
+  JBCLASSER *classer =
+    jbCorrelationInitWithoutComponents (JB_CONN_COMPS, 9999, 9999, 0.97,
+					0.0);
+  PIX *page = pixCreate (w, h, 1);
+
+  for (i = 0; i < 3; i++)
+    {
+      pixaAddPix (classer->pixat, make_template (i), L_INSERT);
+    }
+  classer->nclass = 3;
+
+  for (i = 0; i < ncomp; i++)
+    {
+      l_int32 x = i * (FRAME + 8) + 4;
+      l_int32 y = 4;
+
+      pixRasterop (page, x, y, FRAME, FRAME, PIX_PAINT,
+		   classer->pixat->pix[instances[i]], 0, 0);
+      numaAddNumber (classer->naclass, instances[i]);
+      numaAddNumber (classer->napage, 0);
+      ptaAddPt (classer->ptaul, x, y);
+    }
+  classer->npages = 1;
+  classer->w = w;
+  classer->h = h;
+
+  struct class_averages *averages = create_class_averages ();
+  add_to_class_averages (averages, classer, page, 0);
+
+  struct template_store *store;
+  JBDATA *data = save_classes (classer, 0, &store);
+
+  int removed = consolidate_classes (data, &store, averages, 0.8, 0.0);
+
+  if (removed != 2 || data->nclass != 1)
+    {
+      printf ("FAIL: expected 2 classes merged and 1 left, got %d and %d\n",
+	      removed, data->nclass);
+      failed = 1;
+    }
+
+  /*
+     Drawn with the common square, the page differs from the original
+     by the missing corner of class 1 and the extra pixels of class 2,
+     one for each instance. A template drawn out of place would differ
+     by whole glyph edges.
+   */
+  PIXA *templates = extract_templates (store);
+  PIX *rendered = render_templates (data, templates, 0, ncomp, w, h);
+  PIX *diff = pixXor (NULL, rendered, page);
+  l_int32 count;
+
+  pixCountPixels (diff, &count, NULL);
+
+  if (count != 3)
+    {
+      printf ("FAIL: rendered page differs by %d pixels, expected 3\n",
+	      count);
+      failed = 1;
+    }
+
+  pixDestroy (&diff);
+  pixDestroy (&rendered);
+  pixaDestroy (&templates);
+  destroy_template_store (store);
+  destroy_class_averages (averages);
+  jbDataDestroy (&data);
+  jbClasserDestroy (&classer);
+  pixDestroy (&page);
+
+  if (!failed)
+    printf ("PASS: consolidate\n");
+
+  return failed;
+}